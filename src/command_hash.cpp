@@ -0,0 +1,128 @@
+#include "command_hash.hpp"
+
+#include <iostream>
+
+#include "path_utils.hpp"
+
+std::optional<std::string> CommandHash::lookup(const std::string &name, const PathResolver &resolver)
+{
+  if (name.empty() || name.find('/') != std::string::npos)
+    return resolver.findExecutable(name);
+
+  auto it{entries.find(name)};
+  if (it == entries.end())
+  {
+    it = entries.emplace(name, resolve(name, resolver)).first;
+    insertionOrder.push_back(name);
+  }
+  else if (!isFresh(it->second, resolver))
+  {
+    const std::size_t hits{it->second.hits};
+    it->second = resolve(name, resolver);
+    it->second.hits = hits;
+  }
+
+  ++it->second.hits;
+  return it->second.path;
+}
+
+void CommandHash::clear()
+{
+  entries.clear();
+  insertionOrder.clear();
+}
+
+int CommandHash::runHash(const std::vector<std::string> &args, PathResolver &resolver, OutputBuffer &out)
+{
+  if (resolver.refresh())
+    clear();
+
+  if (args.size() <= 1)
+  {
+    printTable(out);
+    return 0;
+  }
+
+  std::size_t first{1};
+  if (args[1] == "-r")
+  {
+    clear();
+    first = 2;
+  }
+  else if (!args[1].empty() && args[1][0] == '-')
+  {
+    std::cerr << "hash: " << args[1] << ": invalid option\n";
+    return 1;
+  }
+
+  int rc{0};
+  for (std::size_t i{first}; i < args.size(); ++i)
+  {
+    const std::string &name{args[i]};
+    if (name.find('/') != std::string::npos)
+      continue;
+
+    Entry entry{resolve(name, resolver)};
+    if (!entry.path)
+    {
+      std::cerr << "hash: " << name << ": not found\n";
+      rc = 1;
+    }
+    if (entries.find(name) == entries.end())
+      insertionOrder.push_back(name);
+    entries[name] = std::move(entry);
+  }
+  return rc;
+}
+
+CommandHash::Entry CommandHash::resolve(const std::string &name, const PathResolver &resolver) const
+{
+  Entry entry{};
+  std::size_t dirIndex{};
+  entry.path = resolver.findExecutable(name, &dirIndex);
+
+  const auto &dirs{resolver.directories()};
+  const std::size_t stampCount{entry.path ? dirIndex + 1 : dirs.size()};
+  entry.dirStamps.reserve(stampCount);
+  for (std::size_t i{}; i < stampCount; ++i)
+    entry.dirStamps.push_back(directoryStamp(dirs[i]));
+  return entry;
+}
+
+bool CommandHash::isFresh(const Entry &entry, const PathResolver &resolver) const
+{
+  const auto &dirs{resolver.directories()};
+  if (!entry.path && entry.dirStamps.size() != dirs.size())
+    return false;
+  if (entry.dirStamps.size() > dirs.size())
+    return false;
+
+  for (std::size_t i{}; i < entry.dirStamps.size(); ++i)
+  {
+    if (!sameStamp(directoryStamp(dirs[i]), entry.dirStamps[i]))
+      return false;
+  }
+  return true;
+}
+
+void CommandHash::printTable(OutputBuffer &out) const
+{
+  if (entries.empty())
+  {
+    out.append("hash: hash table empty\n");
+    return;
+  }
+
+  out.append("hits\tcommand\n");
+  for (const auto &name : insertionOrder)
+  {
+    const auto it{entries.find(name)};
+    if (it == entries.end())
+      continue;
+    out.appendNumber(static_cast<long long>(it->second.hits), 4).append('\t');
+    if (it->second.path)
+      out.append(*it->second.path).append('\n');
+    else
+      out.append(name).append(" (not found)\n");
+  }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <ctime>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "output_buffer.hpp"
+#include "path_resolver.hpp"
+
+class CommandHash
+{
+public:
+  std::optional<std::string> lookup(const std::string &name, const PathResolver &resolver);
+  void clear();
+  int runHash(const std::vector<std::string> &args, PathResolver &resolver, OutputBuffer &out);
+
+private:
+  // A cached resolution. `path` is empty for a negative entry. `dirStamps`
+  // holds the mtimes of every PATH directory up to and including the one
+  // the command was found in (all of them for a miss); a change in any of
+  // them means the answer could differ now.
+  struct Entry
+  {
+    std::optional<std::string> path{};
+    std::vector<timespec> dirStamps{};
+    std::size_t hits{0};
+  };
+
+  std::unordered_map<std::string, Entry> entries{};
+  std::vector<std::string> insertionOrder{};
+
+  Entry resolve(const std::string &name, const PathResolver &resolver) const;
+  bool isFresh(const Entry &entry, const PathResolver &resolver) const;
+  void printTable(OutputBuffer &out) const;
+};
@@ -0,0 +1,83 @@
+#include "command_usage.hpp"
+
+#include <algorithm>
+#include <cctype>
+
+void CommandUsage::record(std::string_view line)
+{
+  ++clock;
+  bool commandPosition{true};
+  std::size_t start{std::string_view::npos};
+  auto endWord{[&](std::size_t end)
+               {
+                 if (start == std::string_view::npos)
+                   return;
+                 const std::string_view word{line.substr(start, end - start)};
+                 start = std::string_view::npos;
+                 // `time` is a keyword only where a command could start.
+                 if (commandPosition && word != "time")
+                 {
+                   count(word);
+                   commandPosition = false;
+                 }
+               }};
+
+  // Words end at whitespace and at `|` and `&`, as in the tokenizer; `&`
+  // right after `>` belongs to a redirection (`2>&1`).
+  for (std::size_t position{}; position < line.size(); ++position)
+  {
+    const char c{line[position]};
+    if (std::isspace(static_cast<unsigned char>(c)))
+      endWord(position);
+    else if (c == '|' || (c == '&' && !(start != std::string_view::npos && line[position - 1] == '>')))
+    {
+      endWord(position);
+      commandPosition = true;
+    }
+    else if (start == std::string_view::npos)
+      start = position;
+  }
+  endWord(line.size());
+}
+
+double CommandUsage::frecency(std::string_view name) const
+{
+  const auto it{slots.find(name)};
+  if (it == slots.end())
+    return 0.0;
+
+  const Counter &counter{counters[it->second]};
+  const std::uint32_t age{clock - counter.lastUse};
+  double weight{0.5};
+  if (age < 16)
+    weight = 4.0;
+  else if (age < 128)
+    weight = 2.0;
+  else if (age < 1024)
+    weight = 1.0;
+  return counter.uses * weight;
+}
+
+double CommandUsage::maxFrecency() const
+{
+  return maxUses * 4.0;
+}
+
+std::size_t CommandUsage::size() const
+{
+  return counters.size();
+}
+
+void CommandUsage::count(std::string_view name)
+{
+  auto it{slots.find(name)};
+  if (it == slots.end())
+  {
+    it = slots.emplace(std::string{name}, static_cast<std::uint32_t>(counters.size())).first;
+    counters.emplace_back();
+  }
+  Counter &counter{counters[it->second]};
+  ++counter.uses;
+  counter.lastUse = clock;
+  maxUses = std::max(maxUses, counter.uses);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// How often and how recently each command name was run, from the history
+// lines fed to record(). Names map to a slot in a flat array of counters,
+// so a lookup is one hash probe and a counter is eight bytes.
+class CommandUsage
+{
+public:
+  // Counts the command word of every pipeline stage and list element of
+  // `line`.
+  void record(std::string_view line);
+  // Uses weighted by recency; 0 for a name never run.
+  double frecency(std::string_view name) const;
+  // No name's frecency exceeds this.
+  double maxFrecency() const;
+  std::size_t size() const;
+
+private:
+  struct Counter
+  {
+    std::uint32_t uses{0};
+    std::uint32_t lastUse{0};
+  };
+
+  struct NameHash
+  {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view name) const
+    {
+      return std::hash<std::string_view>{}(name);
+    }
+  };
+
+  std::unordered_map<std::string, std::uint32_t, NameHash, std::equal_to<>> slots{};
+  std::vector<Counter> counters{};
+  // Advances once per recorded line.
+  std::uint32_t clock{0};
+  std::uint32_t maxUses{0};
+
+  void count(std::string_view name);
+};
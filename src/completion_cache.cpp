@@ -0,0 +1,155 @@
+#include "completion_cache.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <system_error>
+#include <unistd.h>
+
+#include "path_utils.hpp"
+
+namespace
+{
+  constexpr char cacheMagic[8]{'S', 'H', 'C', 'O', 'M', 'P', 'I', 'X'};
+  constexpr std::uint32_t cacheVersion{2};
+
+  struct CacheHeader
+  {
+    char magic[8]{};
+    std::uint32_t version{};
+    std::uint32_t keySize{};
+    std::uint32_t dirCount{};
+    std::uint32_t reserved{};
+    std::uint64_t imageOffset{};
+    std::uint64_t imageSize{};
+  };
+
+  struct StoredStamp
+  {
+    std::int64_t seconds{};
+    std::int64_t nanoseconds{};
+  };
+
+  std::size_t alignTo8(std::size_t value)
+  {
+    return (value + 7) & ~std::size_t{7};
+  }
+}
+
+CompletionCache::CompletionCache(const Environment &environment)
+    : environment{&environment}
+{
+}
+
+bool CompletionCache::load(const std::string &key, const std::vector<std::filesystem::path> &dirs, Trie &trie)
+{
+  const auto path{cacheFile(key)};
+  if (!path)
+    return false;
+
+  MappedFile file{MappedFile::open(path->string())};
+  if (!file || file.size() < sizeof(CacheHeader))
+    return false;
+
+  CacheHeader header{};
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != cacheVersion)
+    return false;
+  if (header.keySize != key.size() || header.dirCount != dirs.size())
+    return false;
+
+  const std::size_t stampOffset{alignTo8(sizeof(header) + header.keySize)};
+  const std::size_t stampEnd{stampOffset + header.dirCount * sizeof(StoredStamp)};
+  if (stampEnd > file.size() || header.imageOffset < stampEnd || header.imageOffset % 8 != 0 ||
+      header.imageOffset > file.size() || header.imageSize != file.size() - header.imageOffset)
+    return false;
+  if (std::memcmp(file.data() + sizeof(header), key.data(), key.size()) != 0)
+    return false;
+
+  for (std::size_t i{}; i < dirs.size(); ++i)
+  {
+    StoredStamp stored{};
+    std::memcpy(&stored, file.data() + stampOffset + i * sizeof(StoredStamp), sizeof(stored));
+    const timespec current{directoryStamp(dirs[i])};
+    if (stored.seconds != current.tv_sec || stored.nanoseconds != current.tv_nsec)
+      return false;
+  }
+
+  if (!trie.attachImage(file.data() + header.imageOffset, header.imageSize))
+    return false;
+  mapping = std::move(file);
+  return true;
+}
+
+void CompletionCache::store(const std::string &key, const std::vector<timespec> &stamps, const Trie &trie) const
+{
+  const auto path{cacheFile(key)};
+  if (!path)
+    return;
+
+  std::error_code ec{};
+  std::filesystem::create_directories(path->parent_path(), ec);
+  if (ec)
+    return;
+
+  const std::string image{trie.serialize()};
+  CacheHeader header{};
+  std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+  header.version = cacheVersion;
+  header.keySize = static_cast<std::uint32_t>(key.size());
+  header.dirCount = static_cast<std::uint32_t>(stamps.size());
+  const std::size_t stampOffset{alignTo8(sizeof(header) + key.size())};
+  header.imageOffset = alignTo8(stampOffset + stamps.size() * sizeof(StoredStamp));
+  header.imageSize = image.size();
+
+  std::string contents(header.imageOffset, '\0');
+  std::memcpy(contents.data(), &header, sizeof(header));
+  std::memcpy(contents.data() + sizeof(header), key.data(), key.size());
+  for (std::size_t i{}; i < stamps.size(); ++i)
+  {
+    const StoredStamp stored{stamps[i].tv_sec, stamps[i].tv_nsec};
+    std::memcpy(contents.data() + stampOffset + i * sizeof(StoredStamp), &stored, sizeof(stored));
+  }
+  contents += image;
+
+  // Write to a private name and rename, so concurrent shells never map a
+  // half-written index.
+  const std::filesystem::path tempPath{path->string() + "." + std::to_string(::getpid()) + ".tmp"};
+  {
+    std::ofstream out{tempPath, std::ios::binary | std::ios::trunc};
+    if (!out.write(contents.data(), static_cast<std::streamsize>(contents.size())))
+    {
+      std::filesystem::remove(tempPath, ec);
+      return;
+    }
+  }
+  std::filesystem::rename(tempPath, *path, ec);
+  if (ec)
+    std::filesystem::remove(tempPath, ec);
+}
+
+std::vector<timespec> CompletionCache::stampDirectories(const std::vector<std::filesystem::path> &dirs)
+{
+  std::vector<timespec> stamps{};
+  stamps.reserve(dirs.size());
+  for (const auto &dir : dirs)
+    stamps.push_back(directoryStamp(dir));
+  return stamps;
+}
+
+std::optional<std::filesystem::path> CompletionCache::cacheFile(const std::string &key) const
+{
+  std::filesystem::path base{};
+  if (const char *cacheHome{environment->get("XDG_CACHE_HOME")}; cacheHome && *cacheHome)
+    base = cacheHome;
+  else if (const char *home{environment->get("HOME")}; home && *home)
+    base = std::filesystem::path{home} / ".cache";
+  else
+    return std::nullopt;
+
+  char name[64]{};
+  std::snprintf(name, sizeof(name), "completion-%016zx.idx", std::hash<std::string>{}(key));
+  return normalizePath(base.string()) / "codecrafters-shell" / name;
+}
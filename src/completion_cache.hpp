@@ -0,0 +1,30 @@
+#pragma once
+
+#include <ctime>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "environment.hpp"
+#include "mapped_file.hpp"
+#include "trie.hpp"
+
+// On-disk copy of the completion trie, stored under the user's cache
+// directory and keyed by the index inputs (PATH value and builtin names)
+// plus the mtime of every PATH directory at scan time.
+class CompletionCache
+{
+public:
+  explicit CompletionCache(const Environment &environment);
+
+  bool load(const std::string &key, const std::vector<std::filesystem::path> &dirs, Trie &trie);
+  void store(const std::string &key, const std::vector<timespec> &stamps, const Trie &trie) const;
+  static std::vector<timespec> stampDirectories(const std::vector<std::filesystem::path> &dirs);
+
+private:
+  const Environment *environment{nullptr};
+  MappedFile mapping{};
+
+  std::optional<std::filesystem::path> cacheFile(const std::string &key) const;
+};
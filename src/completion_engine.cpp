@@ -1,33 +1,199 @@
 #include "completion_engine.hpp"
 
+#include <algorithm>
 #include <cctype>
+#include <cerrno>
+#include <iterator>
 #include <iostream>
 #include <readline/readline.h>
 #include <unistd.h>
 
+#include "fuzzy_matcher.hpp"
+#include "tracer.hpp"
+
 CompletionEngine *CompletionEngine::activeEngine{nullptr};
 
+namespace
+{
+  // Every character the tokenizer treats specially outside quotes, plus the
+  // redirection operators, which are only recognised as bare words.
+  bool needsEscape(char c)
+  {
+    return c == '|' || c == '&' || c == '\'' || c == '"' || c == '\\' || c == '$' || c == '`' || c == '>' ||
+           c == '<' || std::isspace(static_cast<unsigned char>(c));
+  }
+
+  std::string escapeWord(std::string_view text)
+  {
+    std::string escaped{};
+    escaped.reserve(text.size());
+    for (char c : text)
+    {
+      if (needsEscape(c))
+        escaped.push_back('\\');
+      escaped.push_back(c);
+    }
+    return escaped;
+  }
+
+  std::string unescapeWord(std::string_view text)
+  {
+    std::string plain{};
+    plain.reserve(text.size());
+    for (std::size_t i{}; i < text.size(); ++i)
+    {
+      if (text[i] == '\\' && i + 1 < text.size())
+        ++i;
+      plain.push_back(text[i]);
+    }
+    return plain;
+  }
+
+  // Length of a redirection operator glued to the word, as in >out or 2>>log.
+  std::size_t redirectionPrefix(std::string_view word)
+  {
+    std::size_t length{0};
+    if (!word.empty() && std::isdigit(static_cast<unsigned char>(word.front())))
+      ++length;
+    if (length >= word.size() || word[length] != '>')
+      return 0;
+    ++length;
+    if (length < word.size() && word[length] == '>')
+      ++length;
+    return length;
+  }
+}
+
+CompletionEngine::CompletionEngine(const Environment &environment)
+    : environment{&environment},
+      pathResolver{environment},
+      completionCache{environment}
+{
+}
+
 void CompletionEngine::registerBuiltin(const std::string &name)
 {
   builtinNames.push_back(name);
   completionTrie.insert(name, Trie::NodeKind::Builtin);
+  fuzzyNamesStale = true;
 }
 
 void CompletionEngine::refreshExecutables()
 {
-  if (!pathResolver.refresh())
-    return;
-  rebuildTrie();
+  if (pathResolver.refresh())
+  {
+    applyPathChange();
+    pathWatcher.watch(pathResolver.directories());
+  }
+  // Directories that stayed on PATH keep their watches, so changes queued
+  // before a PATH edit are still applied here.
+  applyWatchEvents();
+}
+
+void CompletionEngine::setFuzzyMatching(const CommandUsage *usage)
+{
+  fuzzyUsage = usage;
 }
 
 void CompletionEngine::rebuildTrie()
 {
+  Tracer::Span span{"CompletionEngine::rebuildTrie"};
   completionTrie.clear();
   for (const auto &name : builtinNames)
     completionTrie.insert(name, Trie::NodeKind::Builtin);
 
-  pathResolver.forEachExecutable([&](const std::filesystem::path &path)
-                                 { completionTrie.insert(path.filename().string(), Trie::NodeKind::PathExecutable); });
+  pathResolver.forEachExecutable([&](const std::string &name)
+                                 { completionTrie.insert(name, Trie::NodeKind::PathExecutable); });
+  indexedDirs = pathResolver.directories();
+  fuzzyNamesStale = true;
+  Tracer::counter("trie bytes", static_cast<long long>(completionTrie.memoryUsage()));
+}
+
+void CompletionEngine::loadIndex()
+{
+  Tracer::Span span{"CompletionEngine::loadIndex"};
+  const auto &dirs{pathResolver.directories()};
+  const std::string key{indexKey()};
+  if (completionCache.load(key, dirs, completionTrie))
+  {
+    indexedDirs = dirs;
+    fuzzyNamesStale = true;
+    return;
+  }
+
+  // Stamp before scanning so a change racing the scan makes the stored
+  // index stale instead of silently missing an entry.
+  const auto stamps{CompletionCache::stampDirectories(dirs)};
+  rebuildTrie();
+  completionCache.store(key, stamps, completionTrie);
+}
+
+std::string CompletionEngine::indexKey() const
+{
+  std::string key{pathResolver.pathValue()};
+  for (const auto &name : builtinNames)
+  {
+    key.push_back('\n');
+    key += name;
+  }
+  return key;
+}
+
+void CompletionEngine::applyPathChange()
+{
+  if (indexedDirs.empty())
+  {
+    loadIndex();
+    return;
+  }
+
+  const auto &dirs{pathResolver.directories()};
+  auto isListed{[](const std::vector<std::filesystem::path> &list, const std::filesystem::path &dir)
+                { return std::find(list.begin(), list.end(), dir) != list.end(); }};
+
+  std::vector<std::filesystem::path> removedDirs{};
+  std::copy_if(indexedDirs.begin(), indexedDirs.end(), std::back_inserter(removedDirs),
+               [&](const std::filesystem::path &dir)
+               { return !isListed(dirs, dir); });
+  std::vector<std::filesystem::path> addedDirs{};
+  std::copy_if(dirs.begin(), dirs.end(), std::back_inserter(addedDirs),
+               [&](const std::filesystem::path &dir)
+               { return !isListed(indexedDirs, dir); });
+
+  // Names from directories that left PATH may still be provided by another
+  // one, so each is re-resolved; directories that joined PATH only add.
+  PathResolver::forEachExecutableIn(removedDirs, [&](const std::string &name)
+                                    { reindexName(name); });
+  PathResolver::forEachExecutableIn(addedDirs, [&](const std::string &name)
+                                    { completionTrie.insert(name, Trie::NodeKind::PathExecutable); });
+  indexedDirs = dirs;
+  fuzzyNamesStale = true;
+}
+
+void CompletionEngine::applyWatchEvents()
+{
+  if (!pathWatcher.drain([this](const std::string &name)
+                         { reindexName(name); }))
+  {
+    rebuildTrie();
+    pathWatcher.watch(pathResolver.directories());
+  }
+}
+
+void CompletionEngine::reindexName(const std::string &name)
+{
+  if (isBuiltin(name))
+    return;
+  fuzzyNamesStale = true;
+  if (pathResolver.findExecutable(name))
+    completionTrie.insert(name, Trie::NodeKind::PathExecutable);
+  else
+    completionTrie.remove(name);
+}
+
+bool CompletionEngine::isBuiltin(const std::string &name) const
+{
+  return std::find(builtinNames.begin(), builtinNames.end(), name) != builtinNames.end();
 }
 
 void CompletionEngine::resetState()
@@ -55,6 +221,7 @@ int CompletionEngine::handleTab(int, int)
 
 int CompletionEngine::handleTabImpl()
 {
+  Tracer::Span span{"CompletionEngine::handleTabImpl"};
   const char *buffer{rl_line_buffer};
   if (!buffer)
     return 0;
@@ -65,14 +232,14 @@ int CompletionEngine::handleTabImpl()
     point = line.size();
 
   std::size_t start{point};
-  while (start > 0 && !std::isspace(static_cast<unsigned char>(line[start - 1])))
+  while (start > 0 && (!std::isspace(static_cast<unsigned char>(line[start - 1])) ||
+                       (start >= 2 && line[start - 2] == '\\')))
     --start;
 
-  if (start != 0)
-  {
-    resetState();
-    return 0;
-  }
+  // Arguments, redirection targets and command words naming a path
+  // complete against the filesystem; a bare first word against commands.
+  if (start != 0 || line.find('/', start) < point)
+    return completePath(line, start, point);
 
   std::string prefix{line.substr(0, point)};
   if (prefix.empty())
@@ -82,18 +249,23 @@ int CompletionEngine::handleTabImpl()
   }
 
   refreshExecutables();
-  auto matches{completionTrie.collectWithPrefix(prefix)};
-  if (matches.empty())
+  if (fuzzyUsage)
+    return completeFuzzy(line, prefix, point);
+
+  // Counting is a subtree-size read; matches are only materialized when
+  // they are actually listed.
+  const std::size_t matchCount{completionTrie.countWithPrefix(prefix)};
+  if (matchCount == 0)
   {
     resetState();
     ::write(STDOUT_FILENO, "\x07", 1);
     return 0;
   }
 
-  if (matches.size() == 1)
+  if (matchCount == 1)
   {
     resetState();
-    const std::string &full{matches.front()};
+    const std::string full{completionTrie.uniqueCompletion(prefix).value_or(prefix)};
     if (full.size() > prefix.size())
     {
       std::string suffix{full.substr(prefix.size())};
@@ -122,6 +294,178 @@ int CompletionEngine::handleTabImpl()
     return 0;
   }
 
+  if (completionState.isPendingFor(line, point))
+  {
+    resetState();
+    std::cout << "\n";
+    bool shouldList{true};
+    if (matchCount > completionQueryItems)
+    {
+      std::cout << "Display all " << matchCount << " possibilities? (y or n)\n";
+      std::cout.flush();
+      int choice{rl_read_key()};
+      if (choice != 'y' && choice != 'Y')
+        shouldList = false;
+    }
+
+    if (shouldList)
+      listMatches(completionTrie.collectWithPrefix(prefix, matchCount));
+
+    rl_on_new_line();
+    rl_redisplay();
+
+    ::write(STDOUT_FILENO, "\x07", 1);
+    return 0;
+  }
+  ::write(STDOUT_FILENO, "\x07", 1);
+  completionState.markPending(line, point);
+  return 0;
+}
+
+int CompletionEngine::completeFuzzy(const std::string &line, const std::string &prefix, std::size_t point)
+{
+  refreshFuzzyNames();
+  const auto matches{FuzzyMatcher{prefix}.best(fuzzyNames, fuzzyMasks, fuzzyUsage, completionQueryItems)};
+  if (matches.empty())
+  {
+    resetState();
+    ::write(STDOUT_FILENO, "\x07", 1);
+    return 0;
+  }
+
+  if (matches.size() == 1)
+  {
+    resetState();
+    std::string replacement{matches.front().name};
+    replacement.push_back(' ');
+    rl_delete_text(0, static_cast<int>(point));
+    rl_point = 0;
+    rl_insert_text(replacement.c_str());
+    rl_redisplay();
+    ::write(STDOUT_FILENO, "\x07", 1);
+    return 0;
+  }
+
+  // A common extension of the typed prefix is still inserted first, so
+  // fuzzy mode completes a plain prefix just as before.
+  std::string lcp{completionTrie.longestCommonPrefix(prefix)};
+  if (lcp.size() > prefix.size())
+  {
+    resetState();
+    rl_insert_text(lcp.substr(prefix.size()).c_str());
+    rl_redisplay();
+    ::write(STDOUT_FILENO, "\x07", 1);
+    return 0;
+  }
+
+  if (completionState.isPendingFor(line, point))
+  {
+    resetState();
+    std::cout << "\n";
+    std::vector<std::string> names{};
+    names.reserve(matches.size());
+    for (const auto &match : matches)
+      names.emplace_back(match.name);
+    listMatches(names);
+    rl_on_new_line();
+    rl_redisplay();
+    ::write(STDOUT_FILENO, "\x07", 1);
+    return 0;
+  }
+  ::write(STDOUT_FILENO, "\x07", 1);
+  completionState.markPending(line, point);
+  return 0;
+}
+
+void CompletionEngine::refreshFuzzyNames()
+{
+  if (!fuzzyNamesStale)
+    return;
+  fuzzyNamesStale = false;
+  fuzzyNames.clear();
+  fuzzyNames.reserve(completionTrie.countWithPrefix(""));
+  completionTrie.visitWithPrefix("", [this](std::string_view name)
+                                 {
+                                   fuzzyNames.emplace_back(name);
+                                   return true;
+                                 });
+  fuzzyMasks.clear();
+  fuzzyMasks.reserve(fuzzyNames.size());
+  for (const auto &name : fuzzyNames)
+    fuzzyMasks.push_back(FuzzyMatcher::maskOf(name));
+}
+
+int CompletionEngine::completePath(const std::string &line, std::size_t start, std::size_t point)
+{
+  const std::string_view typed{std::string_view{line}.substr(start, point - start)};
+  const std::string word{unescapeWord(typed.substr(redirectionPrefix(typed)))};
+  const std::size_t slash{word.rfind('/')};
+  const std::string dirPart{slash == std::string::npos ? "" : word.substr(0, slash + 1)};
+  const std::string namePrefix{word.substr(dirPart.size())};
+
+  std::string dir{dirPart.empty() ? "." : dirPart};
+  if (dir.starts_with("~/"))
+  {
+    const char *home{environment->get("HOME")};
+    if (home && *home)
+      dir = home + dir.substr(1);
+  }
+
+  const auto listing{listingCache.lookup(dir, listingWait)};
+  if (!listing)
+  {
+    resetState();
+    ::write(STDOUT_FILENO, "\x07", 1);
+    return 0;
+  }
+
+  // Entries are sorted, so the candidates are one contiguous run.
+  const auto &entries{listing->entries};
+  auto first{std::lower_bound(entries.begin(), entries.end(), namePrefix, [](const auto &entry, const std::string &value)
+                              { return entry.name < value; })};
+  const bool showHidden{!namePrefix.empty() && namePrefix.front() == '.'};
+  std::vector<const DirectoryScanner::Entry *> matches{};
+  for (auto it{first}; it != entries.end() && it->name.starts_with(namePrefix); ++it)
+  {
+    if (showHidden || it->name.front() != '.')
+      matches.push_back(&*it);
+  }
+
+  if (matches.empty())
+  {
+    resetState();
+    ::write(STDOUT_FILENO, "\x07", 1);
+    return 0;
+  }
+
+  if (matches.size() == 1)
+  {
+    resetState();
+    std::string suffix{escapeWord(std::string_view{matches.front()->name}.substr(namePrefix.size()))};
+    suffix.push_back(matches.front()->directory ? '/' : ' ');
+    rl_insert_text(suffix.c_str());
+    rl_redisplay();
+    ::write(STDOUT_FILENO, "\x07", 1);
+    return 0;
+  }
+
+  std::string_view common{matches.front()->name};
+  for (const auto *match : matches)
+  {
+    std::size_t length{0};
+    while (length < common.size() && length < match->name.size() && common[length] == match->name[length])
+      ++length;
+    common = common.substr(0, length);
+  }
+  if (common.size() > namePrefix.size())
+  {
+    resetState();
+    rl_insert_text(escapeWord(common.substr(namePrefix.size())).c_str());
+    rl_redisplay();
+    ::write(STDOUT_FILENO, "\x07", 1);
+    return 0;
+  }
+
   if (completionState.isPendingFor(line, point))
   {
     resetState();
@@ -138,18 +482,14 @@ int CompletionEngine::handleTabImpl()
 
     if (shouldList)
     {
-      for (std::size_t i{}; i < matches.size(); ++i)
-      {
-        if (i > 0)
-          std::cout << "  ";
-        std::cout << matches[i];
-      }
-      std::cout << "\n";
+      std::vector<std::string> names{};
+      names.reserve(matches.size());
+      for (const auto *match : matches)
+        names.push_back(match->directory ? match->name + "/" : match->name);
+      listMatches(names);
     }
-
     rl_on_new_line();
     rl_redisplay();
-
     ::write(STDOUT_FILENO, "\x07", 1);
     return 0;
   }
@@ -157,3 +497,63 @@ int CompletionEngine::handleTabImpl()
   completionState.markPending(line, point);
   return 0;
 }
+
+void CompletionEngine::listMatches(const std::vector<std::string> &matches)
+{
+  // Rendered into one buffer and written with a single write(). A list
+  // that fits on one line keeps the plain two-space form; a longer one is
+  // laid out in columns down then across, as readline does.
+  int rows{0};
+  int columns{0};
+  rl_get_screen_size(&rows, &columns);
+  const std::size_t width{columns > 0 ? static_cast<std::size_t>(columns) : 80};
+
+  std::size_t longest{0};
+  std::size_t oneLine{0};
+  for (const auto &match : matches)
+  {
+    longest = std::max(longest, match.size());
+    oneLine += match.size() + 2;
+  }
+
+  std::string text{};
+  if (oneLine <= width + 2)
+  {
+    text.reserve(oneLine);
+    for (std::size_t i{}; i < matches.size(); ++i)
+    {
+      if (i > 0)
+        text.append("  ");
+      text.append(matches[i]);
+    }
+    text.push_back('\n');
+  }
+  else
+  {
+    const std::size_t columnWidth{longest + 2};
+    const std::size_t perRow{std::max<std::size_t>(1, width / columnWidth)};
+    const std::size_t rowCount{(matches.size() + perRow - 1) / perRow};
+    text.reserve(rowCount * (width + 1));
+    for (std::size_t row{}; row < rowCount; ++row)
+    {
+      for (std::size_t index{row}; index < matches.size(); index += rowCount)
+      {
+        text.append(matches[index]);
+        if (index + rowCount < matches.size())
+          text.append(columnWidth - matches[index].size(), ' ');
+      }
+      text.push_back('\n');
+    }
+  }
+
+  std::string_view pending{text};
+  while (!pending.empty())
+  {
+    const ssize_t written{::write(STDOUT_FILENO, pending.data(), pending.size())};
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      break;
+    pending.remove_prefix(static_cast<std::size_t>(written));
+  }
+}
@@ -1,20 +1,31 @@
 #pragma once
 
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
+#include "completion_cache.hpp"
+#include "command_usage.hpp"
 #include "completion_state.hpp"
+#include "directory_listing_cache.hpp"
+#include "environment.hpp"
 #include "path_resolver.hpp"
+#include "path_watcher.hpp"
 #include "trie.hpp"
 
 class CompletionEngine
 {
 public:
-  CompletionEngine() = default;
+  explicit CompletionEngine(const Environment &environment);
 
   void registerBuiltin(const std::string &name);
   void refreshExecutables();
+  // With `usage`, command names complete by fuzzy subsequence match,
+  // ranked by match quality and how often and recently each was run;
+  // nullptr restores plain prefix completion.
+  void setFuzzyMatching(const CommandUsage *usage);
 
   class ActiveGuard
   {
@@ -34,13 +45,37 @@ public:
 private:
   Trie completionTrie{};
   CompletionState completionState{};
-  PathResolver pathResolver{};
+  const Environment *environment{nullptr};
+  PathResolver pathResolver;
+  PathWatcher pathWatcher{};
+  CompletionCache completionCache;
+  std::vector<std::filesystem::path> indexedDirs{};
   std::vector<std::string> builtinNames{};
   static constexpr std::size_t completionQueryItems{100};
+  // How long Tab waits for a directory listing before giving up until the
+  // next Tab.
+  static constexpr std::chrono::milliseconds listingWait{50};
+  DirectoryListingCache listingCache{};
+  const CommandUsage *fuzzyUsage{nullptr};
+  // Flat snapshot of the trie's names with their byte masks, taken again
+  // after the trie changes.
+  std::vector<std::string> fuzzyNames{};
+  std::vector<std::uint64_t> fuzzyMasks{};
+  bool fuzzyNamesStale{true};
 
   static CompletionEngine *activeEngine;
 
   void rebuildTrie();
+  void loadIndex();
+  std::string indexKey() const;
+  void applyPathChange();
+  void applyWatchEvents();
+  void reindexName(const std::string &name);
+  bool isBuiltin(const std::string &name) const;
   void resetState();
   int handleTabImpl();
+  int completeFuzzy(const std::string &line, const std::string &prefix, std::size_t point);
+  int completePath(const std::string &line, std::size_t start, std::size_t point);
+  void listMatches(const std::vector<std::string> &matches);
+  void refreshFuzzyNames();
 };
@@ -0,0 +1,109 @@
+#include "directory_listing_cache.hpp"
+
+#include <algorithm>
+#include <sys/stat.h>
+#include <tuple>
+
+#include "path_utils.hpp"
+#include "tracer.hpp"
+
+std::shared_ptr<const DirectoryListingCache::Listing> DirectoryListingCache::lookup(const std::string &dir,
+                                                                                    std::chrono::milliseconds wait)
+{
+  Key key{};
+  timespec stamp{};
+  if (!statDirectory(dir, key, stamp))
+    return std::make_shared<const Listing>();
+
+  std::unique_lock lock{mutex};
+  if (!worker.joinable())
+    worker = std::jthread{[this](std::stop_token stopToken)
+                          { run(stopToken); }};
+
+  if (!slots.contains(key) && slots.size() >= maxDirectories)
+    evictLeastRecentlyUsed();
+  Slot &slot{slots[key]};
+  slot.lastUsed = ++useClock;
+  if (slot.listing && !slot.pending && sameStamp(slot.stamp, stamp))
+    return slot.listing;
+
+  if (!slot.pending)
+  {
+    slot.pending = true;
+    queue.emplace_back(key, dir);
+    workQueued.notify_one();
+  }
+  // A listing finished after this call began is at least as new as the
+  // stamp taken above.
+  if (!listingReady.wait_for(lock, wait, [&slot]()
+                             { return !slot.pending; }))
+    return nullptr;
+  return slot.listing;
+}
+
+void DirectoryListingCache::run(std::stop_token stopToken)
+{
+  while (true)
+  {
+    Key key{};
+    std::string dir{};
+    {
+      std::unique_lock lock{mutex};
+      if (!workQueued.wait(lock, stopToken, [this]()
+                           { return !queue.empty(); }))
+        return;
+      std::tie(key, dir) = std::move(queue.front());
+      queue.pop_front();
+    }
+
+    // Stamp before reading so a change racing the listing leaves it stale.
+    // If the path now names another directory, the listing is not kept.
+    Key current{};
+    timespec stamp{};
+    const bool same{statDirectory(dir, current, stamp) && current == key};
+    auto listing{std::make_shared<Listing>()};
+    {
+      Tracer::Span span{"DirectoryListingCache::list", dir};
+      listing->entries = DirectoryScanner::listDirectory(dir);
+      std::sort(listing->entries.begin(), listing->entries.end(), [](const auto &a, const auto &b)
+                { return a.name < b.name; });
+    }
+
+    {
+      const std::lock_guard lock{mutex};
+      if (auto it{slots.find(key)}; it != slots.end())
+      {
+        if (same)
+        {
+          it->second.listing = std::move(listing);
+          it->second.stamp = stamp;
+        }
+        it->second.pending = false;
+      }
+    }
+    listingReady.notify_all();
+  }
+}
+
+bool DirectoryListingCache::statDirectory(const std::string &dir, Key &key, timespec &stamp)
+{
+  struct stat info{};
+  if (::stat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+    return false;
+  key = Key{info.st_dev, info.st_ino};
+  stamp = info.st_mtim;
+  return true;
+}
+
+void DirectoryListingCache::evictLeastRecentlyUsed()
+{
+  // A pending slot stays: the worker and possibly a waiter still refer to it.
+  auto victim{slots.end()};
+  for (auto it{slots.begin()}; it != slots.end(); ++it)
+  {
+    if (!it->second.pending && (victim == slots.end() || it->second.lastUsed < victim->second.lastUsed))
+      victim = it;
+  }
+  if (victim != slots.end())
+    slots.erase(victim);
+}
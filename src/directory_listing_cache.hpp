@@ -0,0 +1,84 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "directory_scanner.hpp"
+
+// Directory listings for argument completion, read on a worker thread.
+// Listings are keyed by device and inode rather than by the path typed, so
+// "." or "src/" after a cd, or a directory replaced by another of the same
+// name, never picks up another directory's listing. A
+// listing is reused for as long as the directory's mtime is unchanged, so
+// repeated Tabs never relist. A directory that is unknown or has changed is
+// queued for the worker. The caller waits only a bounded time for it, so a
+// huge directory does not block the prompt; its listing is there for the
+// next Tab.
+class DirectoryListingCache
+{
+public:
+  struct Listing
+  {
+    // Sorted by name.
+    std::vector<DirectoryScanner::Entry> entries{};
+  };
+
+  // The current listing of `dir`, or nullptr if it is not ready within
+  // `wait`.
+  std::shared_ptr<const Listing> lookup(const std::string &dir, std::chrono::milliseconds wait);
+
+private:
+  struct Key
+  {
+    dev_t device{};
+    ino_t inode{};
+
+    bool operator==(const Key &) const = default;
+  };
+
+  struct KeyHash
+  {
+    std::size_t operator()(const Key &key) const
+    {
+      return std::hash<std::uint64_t>{}(static_cast<std::uint64_t>(key.inode) * 0x9e3779b97f4a7c15ull ^
+                                        static_cast<std::uint64_t>(key.device));
+    }
+  };
+
+  struct Slot
+  {
+    std::shared_ptr<const Listing> listing{};
+    timespec stamp{};
+    bool pending{false};
+    std::uint64_t lastUsed{0};
+  };
+
+  static constexpr std::size_t maxDirectories{64};
+
+  std::mutex mutex{};
+  std::condition_variable_any workQueued{};
+  std::condition_variable_any listingReady{};
+  std::unordered_map<Key, Slot, KeyHash> slots{};
+  std::deque<std::pair<Key, std::string>> queue{};
+  std::uint64_t useClock{0};
+  // Started on first use; declared last so it stops before the rest goes.
+  std::jthread worker{};
+
+  static bool statDirectory(const std::string &dir, Key &key, timespec &stamp);
+  void run(std::stop_token stopToken);
+  void evictLeastRecentlyUsed();
+};
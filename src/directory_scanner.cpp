@@ -0,0 +1,141 @@
+#include "directory_scanner.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+#include "fd_utils.hpp"
+
+namespace
+{
+  struct LinuxDirent64
+  {
+    std::uint64_t d_ino;
+    std::int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+
+  constexpr std::size_t direntBufferSize{64 * 1024};
+
+  bool isExecutableEntry(int dirFd, const LinuxDirent64 &entry)
+  {
+    // Anything the kernel already tells us is not a file (or a symlink that
+    // may point to one) is skipped without a stat.
+    if (entry.d_type != DT_REG && entry.d_type != DT_LNK && entry.d_type != DT_UNKNOWN)
+      return false;
+
+    struct stat info{};
+    if (::fstatat(dirFd, entry.d_name, &info, 0) != 0)
+      return false;
+    return S_ISREG(info.st_mode) && (info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+  }
+
+  bool isDirectoryEntry(int dirFd, const LinuxDirent64 &entry)
+  {
+    if (entry.d_type != DT_LNK && entry.d_type != DT_UNKNOWN)
+      return entry.d_type == DT_DIR;
+
+    struct stat info{};
+    return ::fstatat(dirFd, entry.d_name, &info, 0) == 0 && S_ISDIR(info.st_mode);
+  }
+
+  bool isDotOrDotDot(const char *name)
+  {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+  }
+}
+
+DirectoryScanner::DirectoryScanner(std::size_t maxThreads)
+    : maxThreads{std::max<std::size_t>(1, maxThreads)}
+{
+}
+
+std::vector<std::vector<std::string>> DirectoryScanner::scan(const std::vector<std::filesystem::path> &dirs) const
+{
+  std::vector<std::vector<std::string>> results(dirs.size());
+  const std::size_t hardwareThreads{std::max(1u, std::thread::hardware_concurrency())};
+  const std::size_t threadCount{std::min({maxThreads, hardwareThreads, dirs.size()})};
+  if (threadCount <= 1)
+  {
+    for (std::size_t i{}; i < dirs.size(); ++i)
+      results[i] = scanDirectory(dirs[i]);
+    return results;
+  }
+
+  std::atomic<std::size_t> nextDir{0};
+  auto worker{[&]()
+              {
+                for (std::size_t i{nextDir++}; i < dirs.size(); i = nextDir++)
+                  results[i] = scanDirectory(dirs[i]);
+              }};
+
+  std::vector<std::jthread> pool{};
+  pool.reserve(threadCount - 1);
+  for (std::size_t i{1}; i < threadCount; ++i)
+    pool.emplace_back(worker);
+  worker();
+  return results;
+}
+
+std::vector<std::string> DirectoryScanner::scanDirectory(const std::filesystem::path &dir)
+{
+  std::vector<std::string> names{};
+  UniqueFd dirFd{::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+  if (!dirFd)
+    return names;
+
+  alignas(LinuxDirent64) char buffer[direntBufferSize];
+  while (true)
+  {
+    const long length{::syscall(SYS_getdents64, dirFd.get(), buffer, sizeof(buffer))};
+    if (length <= 0)
+      break;
+
+    for (long offset{}; offset < length;)
+    {
+      const auto *entry{reinterpret_cast<const LinuxDirent64 *>(buffer + offset)};
+      offset += entry->d_reclen;
+
+      if (isDotOrDotDot(entry->d_name))
+        continue;
+      if (isExecutableEntry(dirFd.get(), *entry))
+        names.emplace_back(entry->d_name);
+    }
+  }
+  return names;
+}
+
+std::vector<DirectoryScanner::Entry> DirectoryScanner::listDirectory(const std::filesystem::path &dir)
+{
+  std::vector<Entry> entries{};
+  UniqueFd dirFd{::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+  if (!dirFd)
+    return entries;
+
+  alignas(LinuxDirent64) char buffer[direntBufferSize];
+  while (true)
+  {
+    const long length{::syscall(SYS_getdents64, dirFd.get(), buffer, sizeof(buffer))};
+    if (length <= 0)
+      break;
+
+    for (long offset{}; offset < length;)
+    {
+      const auto *entry{reinterpret_cast<const LinuxDirent64 *>(buffer + offset)};
+      offset += entry->d_reclen;
+
+      if (!isDotOrDotDot(entry->d_name))
+        entries.push_back({entry->d_name, isDirectoryEntry(dirFd.get(), *entry)});
+    }
+  }
+  return entries;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+class DirectoryScanner
+{
+public:
+  struct Entry
+  {
+    std::string name{};
+    bool directory{false};
+  };
+
+  explicit DirectoryScanner(std::size_t maxThreads = 8);
+
+  // Lists the executable regular files of every directory. Directories are
+  // spread across a small pool of threads; result[i] always belongs to
+  // dirs[i], so callers can merge in PATH order.
+  std::vector<std::vector<std::string>> scan(const std::vector<std::filesystem::path> &dirs) const;
+
+  static std::vector<std::string> scanDirectory(const std::filesystem::path &dir);
+  // Every entry of `dir` except . and .., unsorted. Only entries whose type
+  // getdents does not report are stat'ed.
+  static std::vector<Entry> listDirectory(const std::filesystem::path &dir);
+
+private:
+  std::size_t maxThreads{};
+};
@@ -0,0 +1,116 @@
+#include "environment.hpp"
+
+#include <algorithm>
+#include <cctype>
+
+Environment::Environment(char **initial)
+{
+  for (char **entry{initial}; entry && *entry; ++entry)
+  {
+    const std::string_view text{*entry};
+    const std::size_t separator{text.find('=')};
+    if (separator == std::string_view::npos || separator == 0)
+      continue;
+    set(std::string{text.substr(0, separator)}, text.substr(separator + 1));
+  }
+}
+
+const char *Environment::get(const std::string &name) const
+{
+  if (const auto it{positions.find(name)}; it != positions.end())
+    return entries[it->second].c_str() + name.size() + 1;
+  if (const auto it{shellVariables.find(name)}; it != shellVariables.end())
+    return it->second.c_str();
+  return nullptr;
+}
+
+void Environment::assign(const std::string &name, std::string_view value)
+{
+  if (positions.contains(name))
+  {
+    set(name, value);
+    return;
+  }
+  shellVariables[name].assign(value);
+}
+
+bool Environment::exportVariable(const std::string &name)
+{
+  const auto it{shellVariables.find(name)};
+  if (it == shellVariables.end())
+    return false;
+  const std::string value{std::move(it->second)};
+  shellVariables.erase(it);
+  set(name, value);
+  return true;
+}
+
+void Environment::set(const std::string &name, std::string_view value)
+{
+  shellVariables.erase(name);
+  const auto [it, inserted]{positions.try_emplace(name, entries.size())};
+  if (inserted)
+    entries.emplace_back();
+
+  // Re-setting a value that is already there (PATH from a startup file, an
+  // exported PIPESTATUS that stays 0) keeps the cached envp.
+  std::string &entry{entries[it->second]};
+  if (!inserted && std::string_view{entry}.substr(name.size() + 1) == value)
+    return;
+  pointersValid = false;
+  entry.assign(name);
+  entry.push_back('=');
+  entry.append(value);
+}
+
+bool Environment::unset(const std::string &name)
+{
+  if (shellVariables.erase(name) > 0)
+    return true;
+  const auto it{positions.find(name)};
+  if (it == positions.end())
+    return false;
+
+  // Move the last entry into the hole so the table stays dense.
+  const std::size_t position{it->second};
+  positions.erase(it);
+  if (position + 1 != entries.size())
+  {
+    entries[position] = std::move(entries.back());
+    const std::string_view moved{entries[position]};
+    positions[std::string{moved.substr(0, moved.find('='))}] = position;
+  }
+  entries.pop_back();
+  pointersValid = false;
+  return true;
+}
+
+char *const *Environment::envp()
+{
+  if (!pointersValid)
+  {
+    pointers.clear();
+    pointers.reserve(entries.size() + 1);
+    for (std::string &entry : entries)
+      pointers.push_back(entry.data());
+    pointers.push_back(nullptr);
+    pointersValid = true;
+  }
+  return pointers.data();
+}
+
+std::vector<std::string_view> Environment::sortedEntries() const
+{
+  std::vector<std::string_view> sorted{entries.begin(), entries.end()};
+  std::sort(sorted.begin(), sorted.end(), [](std::string_view a, std::string_view b)
+            { return a.substr(0, a.find('=')) < b.substr(0, b.find('=')); });
+  return sorted;
+}
+
+bool Environment::isValidName(std::string_view name)
+{
+  if (name.empty() || std::isdigit(static_cast<unsigned char>(name.front())))
+    return false;
+  return std::all_of(name.begin(), name.end(), [](char c)
+                     { return c == '_' || std::isalnum(static_cast<unsigned char>(c)); });
+}
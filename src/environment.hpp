@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// The shell's environment. Variables live once, as NAME=value strings,
+// with a hash index from name to entry. The envp array handed to execve
+// and posix_spawn is rebuilt from those strings only after a change, so
+// running many commands between changes costs nothing per command.
+// Shell variables that are not exported (PIPESTATUS) are kept in a table of
+// their own and never reach envp.
+class Environment
+{
+public:
+  explicit Environment(char **initial);
+
+  // The value of `name`, or nullptr if unset. Valid until the next change.
+  const char *get(const std::string &name) const;
+  // Sets and exports `name`.
+  void set(const std::string &name, std::string_view value);
+  // Sets `name` without exporting it; a variable that is already exported
+  // stays exported.
+  void assign(const std::string &name, std::string_view value);
+  // Exports a shell variable set with assign(). Returns false if there is
+  // no such variable.
+  bool exportVariable(const std::string &name);
+  // Returns false if `name` was not set.
+  bool unset(const std::string &name);
+
+  // NULL-terminated NAME=value array, valid until the next change.
+  char *const *envp();
+  // Entries sorted by name, for listings.
+  std::vector<std::string_view> sortedEntries() const;
+
+  static bool isValidName(std::string_view name);
+
+private:
+  std::vector<std::string> entries{};
+  std::unordered_map<std::string, std::size_t> positions{};
+  std::unordered_map<std::string, std::string> shellVariables{};
+  std::vector<char *> pointers{};
+  bool pointersValid{false};
+};
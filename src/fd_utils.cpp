@@ -0,0 +1,31 @@
+#include "fd_utils.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <fstream>
+
+std::size_t PipeFds::maxCapacity()
+{
+  constexpr std::size_t fcntlLimit{INT_MAX};
+  std::size_t maxSize{};
+  std::ifstream limit{"/proc/sys/fs/pipe-max-size"};
+  if (!(limit >> maxSize) || maxSize == 0)
+    return fcntlLimit;
+  return std::min(maxSize, fcntlLimit);
+}
+
+std::size_t PipeFds::grantedCapacity(std::size_t requested)
+{
+  if (requested == 0 || requested > maxCapacity())
+    return 0;
+
+  PipeFds probe{};
+  if (!create(probe))
+    return 0;
+
+  if (::fcntl(probe.write.get(), F_SETPIPE_SZ, static_cast<int>(requested)) < 0)
+    return 0;
+
+  const int granted{::fcntl(probe.write.get(), F_GETPIPE_SZ)};
+  return granted > 0 ? static_cast<std::size_t>(granted) : 0;
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 class UniqueFd
@@ -64,18 +68,44 @@ private:
   int fd{-1};
 };
 
+// pidfd for a child process: it becomes readable once the child exits, so
+// several children can be waited on with one poll(). Empty if the kernel
+// has no pidfd_open (before 5.3); callers then fall back to waitpid.
+inline UniqueFd openPidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return UniqueFd{static_cast<int>(::syscall(SYS_pidfd_open, pid, 0))};
+#else
+  (void)pid;
+  return UniqueFd{};
+#endif
+}
+
 struct PipeFds
 {
   UniqueFd read{};
   UniqueFd write{};
 
-  static bool create(PipeFds &pipeFds)
+  // A capacity of 0 keeps the kernel default. Resizing is best effort: the
+  // pipe is still usable if the kernel refuses the size.
+  static bool create(PipeFds &pipeFds, std::size_t capacity = 0)
   {
     int fds[2]{-1, -1};
-    if (::pipe(fds) != 0)
+    if (::pipe2(fds, O_CLOEXEC) != 0)
       return false;
     pipeFds.read.reset(fds[0]);
     pipeFds.write.reset(fds[1]);
+    if (capacity > 0)
+      ::fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(capacity));
     return true;
   }
+
+  // Largest capacity a pipe can be asked for: /proc/sys/fs/pipe-max-size,
+  // which binds unprivileged users, capped at what F_SETPIPE_SZ accepts.
+  static std::size_t maxCapacity();
+
+  // Capacity the kernel actually grants for a request of at most
+  // maxCapacity(), rounded up to whole pages. Returns 0 if pipes cannot be
+  // resized at all.
+  static std::size_t grantedCapacity(std::size_t requested);
 };
@@ -0,0 +1,123 @@
+#include "fuzzy_matcher.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+  constexpr int startBonus{16};
+  constexpr int consecutiveBonus{12};
+  constexpr int boundaryBonus{8};
+  constexpr int maxGapPenalty{8};
+
+  bool isSeparator(char c)
+  {
+    return c == '-' || c == '_' || c == '.' || c == '/';
+  }
+
+  // Better matches order first. As a heap comparator this keeps the worst
+  // match on top, where the next better one replaces it.
+  bool ranksAbove(const FuzzyMatcher::Match &a, const FuzzyMatcher::Match &b)
+  {
+    if (a.rank != b.rank)
+      return a.rank > b.rank;
+    if (a.name.size() != b.name.size())
+      return a.name.size() < b.name.size();
+    return a.name < b.name;
+  }
+}
+
+FuzzyMatcher::FuzzyMatcher(std::string_view pattern)
+    : pattern{pattern},
+      patternMask{maskOf(pattern)}
+{
+}
+
+std::uint64_t FuzzyMatcher::maskOf(std::string_view text)
+{
+  std::uint64_t mask{0};
+  for (char c : text)
+    mask |= std::uint64_t{1} << (static_cast<unsigned char>(c) & 63);
+  return mask;
+}
+
+std::optional<int> FuzzyMatcher::score(std::string_view candidate, std::uint64_t candidateMask) const
+{
+  if ((patternMask & ~candidateMask) != 0 || pattern.size() > candidate.size())
+    return std::nullopt;
+
+  int total{0};
+  std::size_t position{0};
+  std::size_t previous{std::string_view::npos};
+  for (char c : pattern)
+  {
+    const void *found{std::memchr(candidate.data() + position, c, candidate.size() - position)};
+    if (!found)
+      return std::nullopt;
+
+    const auto index{static_cast<std::size_t>(static_cast<const char *>(found) - candidate.data())};
+    if (index == 0)
+      total += startBonus;
+    else if (isSeparator(candidate[index - 1]))
+      total += boundaryBonus;
+    if (previous != std::string_view::npos)
+    {
+      if (index == previous + 1)
+        total += consecutiveBonus;
+      else
+        total -= static_cast<int>(std::min<std::size_t>(index - previous - 1, maxGapPenalty));
+    }
+    previous = index;
+    position = index + 1;
+  }
+  return total - static_cast<int>((candidate.size() - pattern.size()) / 4);
+}
+
+std::vector<FuzzyMatcher::Match> FuzzyMatcher::best(const std::vector<std::string> &candidates,
+                                                    const std::vector<std::uint64_t> &masks,
+                                                    const CommandUsage *usage,
+                                                    std::size_t limit) const
+{
+  std::vector<Match> heap{};
+  if (limit == 0)
+    return heap;
+  heap.reserve(limit + 1);
+  auto usageBonus{[](double frecency)
+                  { return 10.0 * std::log2(1.0 + frecency); }};
+  const double maxBonus{usage ? usageBonus(usage->maxFrecency()) : 0.0};
+
+  for (std::size_t i{}; i < candidates.size(); ++i)
+  {
+    // Checked here as well as in score() so rejected names are never touched.
+    if ((patternMask & ~masks[i]) != 0)
+      continue;
+    const auto matched{score(candidates[i], masks[i])};
+    if (!matched)
+      continue;
+
+    // Once the heap is full, skip the usage lookup for candidates that
+    // could not make it even with the largest possible bonus.
+    double rank{static_cast<double>(*matched)};
+    if (heap.size() == limit && rank + maxBonus < heap.front().rank)
+      continue;
+    if (usage)
+      rank += usageBonus(usage->frecency(candidates[i]));
+    const Match match{candidates[i], rank};
+    if (heap.size() == limit)
+    {
+      if (!ranksAbove(match, heap.front()))
+        continue;
+      std::pop_heap(heap.begin(), heap.end(), ranksAbove);
+      heap.back() = match;
+    }
+    else
+    {
+      heap.push_back(match);
+    }
+    std::push_heap(heap.begin(), heap.end(), ranksAbove);
+  }
+
+  std::sort_heap(heap.begin(), heap.end(), ranksAbove);
+  return heap;
+}
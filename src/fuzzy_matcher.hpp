@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "command_usage.hpp"
+
+// Subsequence matching for fuzzy completion. Every candidate carries a
+// 64-bit mask of the bytes it contains (folded modulo 64), so most
+// candidates that cannot match are rejected with a single AND. Survivors
+// are scored by locating each pattern byte with memchr. Matches at the
+// start, after a separator or right after the previous match score
+// higher; gaps and extra length score lower.
+class FuzzyMatcher
+{
+public:
+  struct Match
+  {
+    std::string_view name{};
+    double rank{0.0};
+  };
+
+  explicit FuzzyMatcher(std::string_view pattern);
+
+  static std::uint64_t maskOf(std::string_view text);
+  std::optional<int> score(std::string_view candidate, std::uint64_t candidateMask) const;
+
+  // The `limit` best candidates, best first. The match score is combined
+  // with the candidate's frecency from `usage`. A bounded heap keeps only
+  // the leaders, so ranking costs O(n log limit) rather than a full sort.
+  std::vector<Match> best(const std::vector<std::string> &candidates,
+                          const std::vector<std::uint64_t> &masks,
+                          const CommandUsage *usage,
+                          std::size_t limit) const;
+
+private:
+  std::string pattern{};
+  std::uint64_t patternMask{0};
+};
@@ -0,0 +1,90 @@
+#include "history_index.hpp"
+
+#include <algorithm>
+
+void HistoryIndex::add(std::uint64_t id, std::string_view text)
+{
+  collectTrigrams(text, scratch);
+  for (std::uint32_t key : scratch)
+    postings[key].push_back(id);
+  nextId = id + 1;
+}
+
+void HistoryIndex::clear()
+{
+  postings.clear();
+  nextId = 0;
+}
+
+std::uint64_t HistoryIndex::endId() const
+{
+  return nextId;
+}
+
+std::vector<std::uint64_t> HistoryIndex::search(std::string_view query,
+                                                std::size_t limit,
+                                                HistoryStore &store,
+                                                std::uint64_t beforeId) const
+{
+  std::vector<std::uint64_t> results{};
+  if (limit == 0)
+    return results;
+
+  if (query.size() < 3)
+  {
+    store.visitNewestFirst([&](std::uint64_t id, std::string_view line)
+                           {
+                             if (line.find(query) != std::string_view::npos)
+                               results.push_back(id);
+                             return results.size() < limit;
+                           },
+                           beforeId);
+    return results;
+  }
+
+  std::vector<std::uint32_t> keys{};
+  collectTrigrams(query, keys);
+  std::vector<const std::vector<std::uint64_t> *> lists{};
+  lists.reserve(keys.size());
+  for (std::uint32_t key : keys)
+  {
+    const auto it{postings.find(key)};
+    if (it == postings.end())
+      return results;
+    lists.push_back(&it->second);
+  }
+  std::sort(lists.begin(), lists.end(), [](const auto *a, const auto *b)
+            { return a->size() < b->size(); });
+
+  const auto &rarest{*lists.front()};
+  const auto end{std::lower_bound(rarest.begin(), rarest.end(), beforeId)};
+  for (auto it{std::make_reverse_iterator(end)}; it != rarest.rend() && results.size() < limit; ++it)
+  {
+    const std::uint64_t id{*it};
+    const bool inAll{std::all_of(lists.begin() + 1, lists.end(), [id](const auto *list)
+                                 { return std::binary_search(list->begin(), list->end(), id); })};
+    if (!inAll)
+      continue;
+    const auto line{store.entry(id)};
+    if (line && line->find(query) != std::string_view::npos)
+      results.push_back(id);
+  }
+  return results;
+}
+
+void HistoryIndex::collectTrigrams(std::string_view text, std::vector<std::uint32_t> &keys)
+{
+  keys.clear();
+  if (text.size() < 3)
+    return;
+
+  keys.reserve(text.size() - 2);
+  for (std::size_t i{}; i + 2 < text.size(); ++i)
+  {
+    keys.push_back(static_cast<std::uint32_t>(static_cast<unsigned char>(text[i])) << 16 |
+                   static_cast<std::uint32_t>(static_cast<unsigned char>(text[i + 1])) << 8 |
+                   static_cast<std::uint32_t>(static_cast<unsigned char>(text[i + 2])));
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+}
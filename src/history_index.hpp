@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "history_store.hpp"
+
+// Trigram index over the entries of a HistoryStore, keyed by entry id. Every
+// distinct three-byte sequence maps to the ascending list of ids containing
+// it. A substring query walks the rarest of its trigrams' lists from the
+// newest end, checks the other lists by binary search and verifies only the
+// survivors against the store, so it touches a small fraction of a large
+// history. Ids of entries the store has since dropped fail verification;
+// the owner rebuilds the index once they pile up.
+class HistoryIndex
+{
+public:
+  // Entries must be added in increasing id order.
+  void add(std::uint64_t id, std::string_view text);
+  void clear();
+  // One past the last id added.
+  std::uint64_t endId() const;
+
+  // Entries containing `query`, newest first, at most `limit` of them.
+  // Only ids below `beforeId` are considered, so a caller stepping through
+  // matches resumes after the last one instead of starting over. Queries
+  // shorter than a trigram fall back to a scan of the store.
+  std::vector<std::uint64_t> search(std::string_view query,
+                                    std::size_t limit,
+                                    HistoryStore &store,
+                                    std::uint64_t beforeId = std::numeric_limits<std::uint64_t>::max()) const;
+
+private:
+  std::unordered_map<std::uint32_t, std::vector<std::uint64_t>> postings{};
+  std::vector<std::uint32_t> scratch{};
+  std::uint64_t nextId{0};
+
+  static void collectTrigrams(std::string_view text, std::vector<std::uint32_t> &keys);
+};
@@ -1,83 +1,389 @@
 #include "history_manager.hpp"
 
+#include <algorithm>
 #include <cerrno>
+#include <climits>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <fstream>
-#include <iomanip>
 #include <iostream>
+#include <poll.h>
 #include <readline/history.h>
+#include <readline/readline.h>
 #include <unistd.h>
 
 #include "path_utils.hpp"
 
-HistoryManager::HistoryManager(int mainPid)
-    : mainPid{mainPid}
+namespace
+{
+  // Whether more input follows an ESC within readline's keyseq-timeout, as
+  // the rest of an arrow or function key sequence does.
+  bool escapeSequenceFollows()
+  {
+    const char *setting{rl_variable_value("keyseq-timeout")};
+    pollfd input{fileno(rl_instream ? rl_instream : stdin), POLLIN, 0};
+    return poll(&input, 1, setting ? std::atoi(setting) : 500) > 0;
+  }
+}
+
+HistoryManager *HistoryManager::activeManager{nullptr};
+
+HistoryManager::HistoryManager(int mainPid, const Environment &environment)
+    : mainPid{mainPid},
+      environment{&environment}
 {
   using_history();
 }
 
 void HistoryManager::loadFromEnv()
 {
-  const char *historyFile{std::getenv("HISTFILE")};
+  const char *historyFile{environment->get("HISTFILE")};
   if (!historyFile || *historyFile == '\0')
     return;
 
   loadHistoryFromFile(historyFile);
+  sharedFile.attach(normalizePath(std::string{historyFile}).string());
 }
 
 void HistoryManager::saveToEnv()
 {
   if (static_cast<int>(::getpid()) != mainPid)
     return;
+  // Shared sessions append instead: rewriting the file would drop what the
+  // other sessions added.
+  if (shareHistory)
+  {
+    if (!shareUnsaved())
+      std::cerr << "history: " << sharedFile.path() << ": " << std::strerror(errno) << "\n";
+    return;
+  }
 
-  const char *historyFile{std::getenv("HISTFILE")};
+  const char *historyFile{environment->get("HISTFILE")};
   if (!historyFile || *historyFile == '\0')
     return;
 
+  refreshSettings();
   const std::string normalizedPath{normalizePath(std::string{historyFile}).string()};
-  if (write_history(normalizedPath.c_str()) == 0)
-    historyAppendedCount = history_length;
+  if (store.writeTo(normalizedPath, 0, historyFileSize, false))
+    markSaved();
 }
 
 void HistoryManager::addEntry(const std::string &line)
 {
   if (line.empty())
     return;
-  add_history(line.c_str());
+  refreshSettings();
+  if (ignoreSpace && line.front() == ' ')
+    return;
+  if (ignoreDups && store.last() == std::string_view{line})
+    return;
+  if (eraseDups && store.eraseAll(line) > 0)
+    readlineStale = true;
+
+  bool saved{false};
+  if (auto path{shareHistory ? sharedPath() : std::nullopt}; path)
+  {
+    // Entries that missed the file earlier go first, to keep its order.
+    saved = shareUnsaved() && sharedFile.append({line}, [this](std::string_view merged)
+                                                { mergeEntry(merged); });
+    if (!saved)
+      std::cerr << "history: " << *path << ": " << std::strerror(errno) << "\n";
+  }
+
+  store.append(line);
+  const std::uint64_t id{store.endId() - 1};
+  if (!saved && !firstUnsaved)
+    firstUnsaved = id;
+  // Keep readline's list current while it is in step with the store;
+  // otherwise it catches up the next time history is browsed.
+  if (!readlineStale && readlineEnd == id)
+  {
+    add_history(line.c_str());
+    readlineEnd = id + 1;
+  }
+  if (searchIndexActive)
+    updateSearchIndex();
+  if (usageActive)
+    updateCommandUsage();
+}
+
+void HistoryManager::setShareHistory(bool enable)
+{
+  shareHistory = enable;
+  if (enable && !shareUnsaved())
+    std::cerr << "history: " << sharedFile.path() << ": " << std::strerror(errno) << "\n";
+}
+
+void HistoryManager::mergeSharedHistory()
+{
+  if (!shareHistory || !sharedPath())
+    return;
+
+  refreshSettings();
+  if (!sharedFile.pull([this](std::string_view line)
+                       { mergeEntry(line); }))
+    std::cerr << "history: " << sharedFile.path() << ": " << std::strerror(errno) << "\n";
+  if (searchIndexActive)
+    updateSearchIndex();
+  if (usageActive)
+    updateCommandUsage();
 }
 
-int HistoryManager::runHistory(const std::vector<std::string> &args)
+int HistoryManager::runHistory(const std::vector<std::string> &args, OutputBuffer &out)
 {
-  if (auto result{handleOption(args)}; result)
+  if (auto result{handleOption(args, out)}; result)
     return *result;
 
   auto limit{parseLimit(args)};
   if (!limit)
     return 1;
-  printHistory(*limit);
+  printHistory(*limit, out);
   return 0;
 }
 
 bool HistoryManager::loadHistoryFromFile(const std::string &path)
 {
-  std::ifstream file{normalizePath(path)};
-  if (!file.is_open())
+  refreshSettings();
+  if (!store.load(normalizePath(path).string()))
     return false;
 
-  std::string line{};
-  while (std::getline(file, line))
+  markSaved();
+  if (searchIndexActive)
+    updateSearchIndex();
+  if (usageActive)
+    updateCommandUsage();
+  return true;
+}
+
+HistoryManager::ActiveGuard::ActiveGuard(HistoryManager &manager)
+    : previous{activeManager}
+{
+  activeManager = &manager;
+}
+
+HistoryManager::ActiveGuard::~ActiveGuard()
+{
+  activeManager = previous;
+}
+
+void HistoryManager::bindKeys()
+{
+  rl_bind_keyseq("\\e[A", &HistoryManager::previousHistory);
+  rl_bind_keyseq("\\eOA", &HistoryManager::previousHistory);
+  rl_bind_key(CTRL('P'), &HistoryManager::previousHistory);
+  rl_bind_keyseq("\\e<", &HistoryManager::beginningOfHistory);
+  rl_bind_key(CTRL('R'), &HistoryManager::reverseSearchHistory);
+  rl_bind_key(CTRL('S'), &HistoryManager::forwardSearchHistory);
+}
+
+void HistoryManager::refreshSettings()
+{
+  historySize = parseSize("HISTSIZE");
+  historyFileSize = environment->get("HISTFILESIZE") ? parseSize("HISTFILESIZE") : historySize;
+
+  ignoreSpace = ignoreDups = eraseDups = false;
+  const char *control{environment->get("HISTCONTROL")};
+  std::string_view remaining{control ? control : ""};
+  while (!remaining.empty())
   {
-    if (line.empty())
-      continue;
-    add_history(line.c_str());
+    const std::size_t colon{remaining.find(':')};
+    const std::string_view word{remaining.substr(0, colon)};
+    remaining = colon == std::string_view::npos ? std::string_view{} : remaining.substr(colon + 1);
+    if (word == "ignorespace" || word == "ignoreboth")
+      ignoreSpace = true;
+    if (word == "ignoredups" || word == "ignoreboth")
+      ignoreDups = true;
+    if (word == "erasedups")
+      eraseDups = true;
+  }
+
+  if (historySize != appliedHistorySize)
+  {
+    appliedHistorySize = historySize;
+    store.setCapacity(historySize);
+    readlineStale = true;
   }
+}
+
+std::optional<std::string> HistoryManager::sharedPath()
+{
+  const char *historyFile{environment->get("HISTFILE")};
+  if (!historyFile || *historyFile == '\0')
+    return std::nullopt;
+
+  // Following a different file starts from its current end.
+  std::string path{normalizePath(std::string{historyFile}).string()};
+  if (path != sharedFile.path())
+    sharedFile.attach(path);
+  return path;
+}
+
+void HistoryManager::mergeEntry(std::string_view line)
+{
+  // Entries from other sessions are already in the file, so they never
+  // count as unsaved here.
+  if (eraseDups && store.eraseAll(line) > 0)
+    readlineStale = true;
+  store.append(line);
+  if (firstUnsaved)
+    mergedSinceUnsaved.push_back(store.endId() - 1);
+}
 
-  historyAppendedCount = history_length;
+bool HistoryManager::shareUnsaved()
+{
+  // This session's entries that never reached the shared file: those
+  // entered before sharehistory was turned on, and those whose append
+  // failed.
+  if (!firstUnsaved || !sharedPath())
+    return true;
+
+  // Copied out, since merging the other sessions' new entries below
+  // appends to the store.
+  std::vector<std::string> pending{};
+  store.visitFrom(*firstUnsaved, [this, &pending](std::uint64_t id, std::string_view line)
+                  {
+                    if (!std::binary_search(mergedSinceUnsaved.begin(), mergedSinceUnsaved.end(), id))
+                      pending.emplace_back(line);
+                    return true; });
+  const std::vector<std::string_view> lines{pending.begin(), pending.end()};
+  if (!lines.empty() && !sharedFile.append(lines, [this](std::string_view merged)
+                                            { mergeEntry(merged); }))
+    return false;
+  markSaved();
   return true;
 }
 
-std::optional<int> HistoryManager::handleOption(const std::vector<std::string> &args)
+void HistoryManager::markSaved()
+{
+  firstUnsaved.reset();
+  mergedSinceUnsaved.clear();
+}
+
+std::size_t HistoryManager::parseSize(const char *name) const
+{
+  // Unset, empty, negative or malformed values leave history unbounded.
+  const char *value{environment->get(name)};
+  if (!value || *value == '\0')
+    return HistoryStore::unlimited;
+
+  try
+  {
+    std::size_t consumed{};
+    const long long requested{std::stoll(value, &consumed)};
+    if (consumed == std::strlen(value) && requested >= 0)
+      return static_cast<std::size_t>(requested);
+  }
+  catch (const std::exception &)
+  {
+  }
+  return HistoryStore::unlimited;
+}
+
+void HistoryManager::importIntoReadline()
+{
+  refreshSettings();
+  const std::uint64_t end{store.endId()};
+  if (!readlineStale && readlineEnd == end)
+    return;
+
+  // Ids are never reused, so a gap wider than the window holds at most
+  // that many entries to catch up on; anything wider starts over.
+  std::uint64_t first{readlineEnd};
+  if (!readlineStale && end - readlineEnd > readlineWindow)
+    readlineStale = true;
+  if (readlineStale)
+  {
+    clear_history();
+    first = readlineWindowStart();
+    if (historySize > static_cast<std::size_t>(INT_MAX))
+      unstifle_history();
+    else
+      stifle_history(static_cast<int>(historySize));
+  }
+
+  std::string line{};
+  store.visitFrom(first, [&line](std::uint64_t, std::string_view text)
+                  {
+                    line.assign(text);
+                    add_history(line.c_str());
+                    return true;
+                  });
+  readlineEnd = end;
+  readlineStale = false;
+  using_history();
+}
+
+std::uint64_t HistoryManager::readlineWindowStart()
+{
+  std::uint64_t first{store.endId()};
+  std::size_t taken{};
+  readlineHasOlder = false;
+  store.visitNewestFirst([&](std::uint64_t id, std::string_view)
+                         {
+                           if (taken == readlineWindow)
+                           {
+                             readlineHasOlder = true;
+                             return false;
+                           }
+                           first = id;
+                           ++taken;
+                           return true; });
+  return first;
+}
+
+void HistoryManager::extendReadline(int count)
+{
+  // Moving `count` entries back from where readline is would leave the
+  // imported window, so widen it and keep readline on the same entry.
+  const int position{where_history()};
+  if (!readlineHasOlder || count <= position)
+    return;
+
+  const int before{history_length};
+  while (readlineWindow < HistoryStore::unlimited / 2 &&
+         readlineWindow < static_cast<std::size_t>(before) + static_cast<std::size_t>(count))
+    readlineWindow *= 2;
+  readlineStale = true;
+  importIntoReadline();
+  history_set_pos(position + (history_length - before));
+}
+
+void HistoryManager::importActive()
+{
+  if (activeManager)
+    activeManager->importIntoReadline();
+}
+
+int HistoryManager::previousHistory(int count, int key)
+{
+  importActive();
+  if (activeManager)
+    activeManager->extendReadline(count);
+  return rl_get_previous_history(count, key);
+}
+
+int HistoryManager::beginningOfHistory(int count, int key)
+{
+  importActive();
+  if (activeManager)
+    activeManager->extendReadline(INT_MAX);
+  return rl_beginning_of_history(count, key);
+}
+
+int HistoryManager::reverseSearchHistory(int count, int key)
+{
+  if (!activeManager)
+    return rl_reverse_search_history(count, key);
+  return activeManager->incrementalSearch();
+}
+
+int HistoryManager::forwardSearchHistory(int count, int key)
+{
+  importActive();
+  return rl_forward_search_history(count, key);
+}
+
+std::optional<int> HistoryManager::handleOption(const std::vector<std::string> &args, OutputBuffer &out)
 {
   if (args.size() <= 1)
     return std::nullopt;
@@ -93,11 +399,27 @@ std::optional<int> HistoryManager::handleOption(const std::vector<std::string> &
 
   if (option == "-c")
   {
+    store.clear();
+    searchIndex.clear();
+    searchIndexRemoved = store.removedCount();
     clear_history();
-    historyAppendedCount = 0;
+    readlineEnd = store.endId();
+    readlineStale = false;
+    readlineHasOlder = false;
+    markSaved();
     return 0;
   }
 
+  if (option == "-s")
+  {
+    if (args.size() < 3)
+    {
+      std::cerr << "history: -s: missing search string\n";
+      return 1;
+    }
+    return searchHistory(args[2], out);
+  }
+
   if (option == "-w")
   {
     auto path{resolveHistoryPath(args, 2, option)};
@@ -123,6 +445,167 @@ std::optional<int> HistoryManager::handleOption(const std::vector<std::string> &
   return std::nullopt;
 }
 
+void HistoryManager::updateSearchIndex()
+{
+  searchIndexActive = true;
+  // Postings for dropped entries only cost verification misses; rebuild
+  // once there are more of them than live entries.
+  if (store.removedCount() - searchIndexRemoved > store.size())
+  {
+    searchIndex.clear();
+    searchIndexRemoved = store.removedCount();
+  }
+  store.visitFrom(searchIndex.endId(), [this](std::uint64_t id, std::string_view line)
+                  {
+                    searchIndex.add(id, line);
+                    return true;
+                  });
+}
+
+const CommandUsage &HistoryManager::commandUsage()
+{
+  usageActive = true;
+  updateCommandUsage();
+  return usage;
+}
+
+void HistoryManager::updateCommandUsage()
+{
+  // Entries dropped by erasedups or HISTSIZE stay counted: usage reflects
+  // what was run, not what history still shows.
+  store.visitFrom(usageEnd, [this](std::uint64_t, std::string_view line)
+                  {
+                    usage.record(line);
+                    return true;
+                  });
+  usageEnd = store.endId();
+}
+
+int HistoryManager::searchHistory(const std::string &query, OutputBuffer &out)
+{
+  updateSearchIndex();
+  auto matches{searchIndex.search(query, store.size(), store)};
+  if (matches.empty())
+    return 1;
+
+  for (auto it{matches.rbegin()}; it != matches.rend(); ++it)
+  {
+    out.appendNumber(static_cast<long long>(store.numberOf(*it).value_or(0)), 5)
+        .append("  ")
+        .append(*store.entry(*it))
+        .append('\n');
+  }
+  return 0;
+}
+
+int HistoryManager::incrementalSearch()
+{
+  // A small replacement for readline's linear reverse-i-search, backed by
+  // the trigram index: printable keys extend the query, Ctrl-R steps to an
+  // older match, Backspace shortens the query, Ctrl-G restores the line,
+  // Enter runs the match and any other key ends the search and is then
+  // handled as usual.
+  updateSearchIndex();
+  const std::string original{rl_line_buffer ? rl_line_buffer : ""};
+  const std::string originalPrompt{rl_prompt ? rl_prompt : ""};
+  const int originalPoint{rl_point};
+  std::string query{};
+  std::vector<std::uint64_t> matches{};
+  std::size_t current{0};
+  bool failed{false};
+
+  auto show{[&]()
+            {
+              if (!matches.empty())
+              {
+                const std::string line{*store.entry(matches[current])};
+                rl_replace_line(line.c_str(), 0);
+                rl_point = static_cast<int>(line.find(query));
+              }
+              const std::string prompt{std::string{failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`"} +
+                                       query + "': "};
+              rl_set_prompt(prompt.c_str());
+              rl_redisplay();
+            }};
+  auto restart{[&]()
+               {
+                 current = 0;
+                 matches = searchIndex.search(query, 1, store);
+                 failed = !query.empty() && matches.empty();
+                 show();
+               }};
+
+  show();
+  while (true)
+  {
+    const int key{rl_read_key()};
+    if (key == CTRL('G'))
+    {
+      rl_replace_line(original.c_str(), 0);
+      rl_point = originalPoint;
+      rl_set_prompt(originalPrompt.c_str());
+      rl_redisplay();
+      return 0;
+    }
+    if (key == CTRL('R'))
+    {
+      if (query.empty() || matches.empty())
+        continue;
+      // Step past older entries identical to the one shown, each search
+      // resuming below the last match instead of starting from the newest.
+      const std::string shown{*store.entry(matches[current])};
+      std::uint64_t from{matches.back()};
+      bool found{false};
+      while (!found)
+      {
+        const auto next{searchIndex.search(query, 1, store, from)};
+        if (next.empty())
+          break;
+        from = next.front();
+        found = *store.entry(from) != shown;
+      }
+      if (found)
+      {
+        matches.push_back(from);
+        current = matches.size() - 1;
+      }
+      else
+        rl_ding();
+      show();
+      continue;
+    }
+    if (key == '\b' || key == 0x7f)
+    {
+      if (!query.empty())
+        query.pop_back();
+      restart();
+      continue;
+    }
+    if (key == '\r' || key == '\n')
+    {
+      rl_set_prompt(originalPrompt.c_str());
+      rl_redisplay();
+      rl_done = 1;
+      return 0;
+    }
+    if (key >= 0x20 && key != 0x7f)
+    {
+      query.push_back(static_cast<char>(key));
+      restart();
+      continue;
+    }
+
+    // A lone ESC only ends the search. One that starts a key sequence is
+    // handed back whole, so readline's keymap reads the rest of it and runs
+    // the bound command instead of inserting "[A" as text.
+    rl_set_prompt(originalPrompt.c_str());
+    rl_redisplay();
+    if (key != '\033' || escapeSequenceFollows())
+      rl_execute_next(key);
+    return 0;
+  }
+}
+
 std::optional<int> HistoryManager::parseLimit(const std::vector<std::string> &args) const
 {
   if (args.size() <= 1)
@@ -143,26 +626,30 @@ std::optional<int> HistoryManager::parseLimit(const std::vector<std::string> &ar
   return std::nullopt;
 }
 
-void HistoryManager::printHistory(int limit)
+void HistoryManager::printHistory(int limit, OutputBuffer &out)
 {
-  HIST_ENTRY **entries{history_list()};
-  if (!entries)
+  std::optional<std::uint64_t> newestId{};
+  store.visitNewestFirst([&newestId](std::uint64_t id, std::string_view)
+                         {
+                           newestId = id;
+                           return false;
+                         });
+  if (!newestId || limit == 0)
     return;
 
-  int entryCount{};
-  while (entries[entryCount])
-    ++entryCount;
-
-  int startIndex{};
-  if (limit >= 0 && limit < entryCount)
-    startIndex = entryCount - limit;
-
-  for (int i{startIndex}; i < entryCount; ++i)
-  {
-    const int index{history_base + i};
-    const char *line{entries[i]->line ? entries[i]->line : ""};
-    std::cout << std::setw(5) << index << "  " << line << "\n";
-  }
+  // Numbers count entries evicted from the front, as bash does.
+  const std::size_t wanted{limit > 0 ? static_cast<std::size_t>(limit) : HistoryStore::unlimited};
+  const std::size_t newestNumber{*store.numberOf(*newestId)};
+  std::vector<std::string_view> lines{};
+  store.visitNewestFirst([&](std::uint64_t, std::string_view line)
+                         {
+                           lines.push_back(line);
+                           return lines.size() < wanted;
+                         });
+
+  std::size_t number{newestNumber - lines.size()};
+  for (auto it{lines.rbegin()}; it != lines.rend(); ++it)
+    out.appendNumber(static_cast<long long>(++number), 5).append("  ").append(*it).append('\n');
 }
 
 int HistoryManager::readHistoryFromPath(const std::string &path)
@@ -178,33 +665,31 @@ int HistoryManager::readHistoryFromPath(const std::string &path)
 
 int HistoryManager::writeHistoryToPath(const std::string &path)
 {
+  refreshSettings();
   const std::string normalizedPath{normalizePath(path).string()};
-  if (write_history(normalizedPath.c_str()) != 0)
+  if (!store.writeTo(normalizedPath, 0, historyFileSize, false))
   {
     std::cerr << "history: " << path << ": " << std::strerror(errno) << "\n";
     return 1;
   }
-  historyAppendedCount = history_length;
+  markSaved();
+  if (normalizedPath == sharedFile.path())
+    sharedFile.attach(normalizedPath);
   return 0;
 }
 
 int HistoryManager::appendHistoryToPath(const std::string &path)
 {
-  int totalEntries{history_length};
-  if (totalEntries < historyAppendedCount)
-    historyAppendedCount = totalEntries;
-
-  int newEntries{totalEntries - historyAppendedCount};
-  if (newEntries <= 0)
+  if (!firstUnsaved)
     return 0;
 
   const std::string normalizedPath{normalizePath(path).string()};
-  if (append_history(newEntries, normalizedPath.c_str()) != 0)
+  if (!store.writeTo(normalizedPath, *firstUnsaved, HistoryStore::unlimited, true))
   {
     std::cerr << "history: " << path << ": " << std::strerror(errno) << "\n";
     return 1;
   }
-  historyAppendedCount = totalEntries;
+  markSaved();
   return 0;
 }
 
@@ -215,7 +700,7 @@ std::optional<std::string> HistoryManager::resolveHistoryPath(const std::vector<
   if (args.size() > pathIndex)
     return args[pathIndex];
 
-  const char *historyFile{std::getenv("HISTFILE")};
+  const char *historyFile{environment->get("HISTFILE")};
   if (historyFile && *historyFile != '\0')
     return std::string{historyFile};
 
@@ -1,25 +1,119 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <optional>
 #include <string>
 #include <vector>
 
+#include "command_usage.hpp"
+#include "environment.hpp"
+#include "history_index.hpp"
+#include "history_store.hpp"
+#include "output_buffer.hpp"
+#include "shared_history_file.hpp"
+
 class HistoryManager
 {
 public:
-  explicit HistoryManager(int mainPid);
+  HistoryManager(int mainPid, const Environment &environment);
   void loadFromEnv();
   void saveToEnv();
   void addEntry(const std::string &line);
-  int runHistory(const std::vector<std::string> &args);
+  // In shared mode every entry is appended to HISTFILE as it is added and
+  // entries from other sessions are merged in before each prompt.
+  void setShareHistory(bool enable);
+  void mergeSharedHistory();
+  // Per-command usage counts over the history, for ranking completions.
+  // Counting starts with the first call and is kept current from then on.
+  const CommandUsage &commandUsage();
+  int runHistory(const std::vector<std::string> &args, OutputBuffer &out);
+
+  class ActiveGuard
+  {
+  public:
+    explicit ActiveGuard(HistoryManager &manager);
+    ~ActiveGuard();
+
+    ActiveGuard(const ActiveGuard &) = delete;
+    ActiveGuard &operator=(const ActiveGuard &) = delete;
+
+  private:
+    HistoryManager *previous{nullptr};
+  };
+
+  // Binds the readline commands that walk back through history. Entries
+  // loaded from a file reach readline's own list only when one of them is
+  // first used, which keeps startup independent of the file's size, and
+  // then only the newest few thousand; walking back past the oldest of
+  // them imports twice as many. Readline's list is stifled to HISTSIZE and
+  // rebuilt after erasedups.
+  static void bindKeys();
 
 private:
-  int historyAppendedCount{0};
+  HistoryStore store{};
+  HistoryIndex searchIndex{};
+  // The search index is built on the first search and kept current from
+  // then on, so shells that never search do not pay for it.
+  bool searchIndexActive{false};
+  // Entries the store had dropped when the index was last rebuilt.
+  std::size_t searchIndexRemoved{0};
+  CommandUsage usage{};
+  bool usageActive{false};
+  std::uint64_t usageEnd{0};
+  // First entry added since the history was last read, written or appended.
+  std::optional<std::uint64_t> firstUnsaved{};
+  // Entries merged from other sessions since firstUnsaved. They are in the
+  // shared file already, so sharing the unsaved entries skips them.
+  std::vector<std::uint64_t> mergedSinceUnsaved{};
+  // Readline's list holds the newest `readlineWindow` entries before this
+  // id, unless it needs a rebuild because entries were erased, the
+  // capacity changed or the window grew. It starts out stale, so the first
+  // use builds it from the window.
+  static constexpr std::size_t readlineBatch{4096};
+  std::uint64_t readlineEnd{0};
+  bool readlineStale{true};
+  std::size_t readlineWindow{readlineBatch};
+  // The store has entries older than any in readline's list.
+  bool readlineHasOlder{false};
   int mainPid{};
+  const Environment *environment{nullptr};
+  bool shareHistory{false};
+  SharedHistoryFile sharedFile{};
+
+  // HISTSIZE, HISTFILESIZE and HISTCONTROL, read again before each use so
+  // assignments take effect at once.
+  std::size_t historySize{HistoryStore::unlimited};
+  std::size_t appliedHistorySize{HistoryStore::unlimited};
+  std::size_t historyFileSize{HistoryStore::unlimited};
+  bool ignoreSpace{false};
+  bool ignoreDups{false};
+  bool eraseDups{false};
+
+  static HistoryManager *activeManager;
+
+  void refreshSettings();
+  std::optional<std::string> sharedPath();
+  void mergeEntry(std::string_view line);
+  bool shareUnsaved();
+  void markSaved();
+  std::size_t parseSize(const char *name) const;
+  void importIntoReadline();
+  std::uint64_t readlineWindowStart();
+  void extendReadline(int count);
+  void updateSearchIndex();
+  void updateCommandUsage();
+  int searchHistory(const std::string &query, OutputBuffer &out);
+  int incrementalSearch();
+  static int previousHistory(int count, int key);
+  static int beginningOfHistory(int count, int key);
+  static int reverseSearchHistory(int count, int key);
+  static int forwardSearchHistory(int count, int key);
+  static void importActive();
 
-  std::optional<int> handleOption(const std::vector<std::string> &args);
+  std::optional<int> handleOption(const std::vector<std::string> &args, OutputBuffer &out);
   std::optional<int> parseLimit(const std::vector<std::string> &args) const;
-  void printHistory(int limit);
+  void printHistory(int limit, OutputBuffer &out);
   int readHistoryFromPath(const std::string &path);
   int writeHistoryToPath(const std::string &path);
   int appendHistoryToPath(const std::string &path);
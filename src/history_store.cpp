@@ -0,0 +1,416 @@
+#include "history_store.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "fd_utils.hpp"
+#include "output_buffer.hpp"
+
+std::string_view HistoryStore::Slot::text() const
+{
+  if (loaded)
+    return {loaded, length};
+  return owned;
+}
+
+void HistoryStore::setCapacity(std::size_t newCapacity)
+{
+  if (newCapacity == capacity)
+    return;
+  // Files read so far are bounded by the capacity in force when they were
+  // read, so place them before it changes.
+  materialize();
+  capacity = newCapacity;
+  while (liveCount > capacity)
+    popFront();
+}
+
+bool HistoryStore::load(const std::string &path)
+{
+  errno = 0;
+  MappedFile file{MappedFile::open(path)};
+  if (!file)
+    return errno == 0;
+
+  files.push_back(std::move(file));
+  ++pendingFiles;
+  return true;
+}
+
+void HistoryStore::append(std::string_view line)
+{
+  materialize();
+  push(line, nullptr, 0);
+}
+
+std::size_t HistoryStore::eraseAll(std::string_view line)
+{
+  materialize();
+  if (!fingerprintsBuilt)
+  {
+    fingerprintsBuilt = true;
+    for (std::size_t i{}; i < count; ++i)
+    {
+      const Slot &slot{slotAt(i)};
+      if (slot.live)
+        fingerprints.emplace(fingerprint(slot.text()), slot.id);
+    }
+  }
+
+  std::vector<std::uint64_t> matches{};
+  const auto range{fingerprints.equal_range(fingerprint(line))};
+  for (auto it{range.first}; it != range.second; ++it)
+    matches.push_back(it->second);
+
+  std::size_t erased{};
+  for (std::uint64_t id : matches)
+  {
+    const auto position{positionOf(id)};
+    if (!position || slotAt(*position).text() != line)
+      continue;
+    kill(slotAt(*position));
+    ++erased;
+  }
+
+  if (count - liveCount > liveCount)
+    compact();
+  return erased;
+}
+
+void HistoryStore::clear()
+{
+  removed += liveCount;
+  files.clear();
+  pendingFiles = 0;
+  slots.clear();
+  loadedText.clear();
+  head = 0;
+  count = 0;
+  liveCount = 0;
+  evictedLive = 0;
+  fingerprints.clear();
+}
+
+std::size_t HistoryStore::size()
+{
+  materialize();
+  return liveCount;
+}
+
+std::uint64_t HistoryStore::endId()
+{
+  materialize();
+  return nextId;
+}
+
+std::optional<std::string_view> HistoryStore::last()
+{
+  materialize();
+  for (std::size_t i{count}; i-- > 0;)
+  {
+    const Slot &slot{slotAt(i)};
+    if (slot.live)
+      return slot.text();
+  }
+  return std::nullopt;
+}
+
+std::optional<std::string_view> HistoryStore::entry(std::uint64_t id)
+{
+  const auto position{positionOf(id)};
+  if (!position)
+    return std::nullopt;
+  return slotAt(*position).text();
+}
+
+std::optional<std::size_t> HistoryStore::numberOf(std::uint64_t id)
+{
+  materialize();
+  if (count != liveCount)
+    compact();
+  const auto position{positionOf(id)};
+  if (!position)
+    return std::nullopt;
+  return evictedLive + *position + 1;
+}
+
+std::size_t HistoryStore::removedCount() const
+{
+  return removed;
+}
+
+void HistoryStore::visitFrom(std::uint64_t firstId, const Visitor &visitor)
+{
+  materialize();
+  std::size_t low{0};
+  std::size_t high{count};
+  while (low < high)
+  {
+    const std::size_t middle{low + (high - low) / 2};
+    if (slotAt(middle).id < firstId)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  for (std::size_t i{low}; i < count; ++i)
+  {
+    const Slot &slot{slotAt(i)};
+    if (slot.live && !visitor(slot.id, slot.text()))
+      return;
+  }
+}
+
+void HistoryStore::visitNewestFirst(const Visitor &visitor, std::uint64_t beforeId)
+{
+  materialize();
+  std::size_t low{0};
+  std::size_t high{count};
+  while (low < high)
+  {
+    const std::size_t middle{low + (high - low) / 2};
+    if (slotAt(middle).id < beforeId)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  for (std::size_t i{low}; i-- > 0;)
+  {
+    const Slot &slot{slotAt(i)};
+    if (slot.live && !visitor(slot.id, slot.text()))
+      return;
+  }
+}
+
+bool HistoryStore::writeTo(const std::string &path, std::uint64_t firstId, std::size_t maxEntries, bool append)
+{
+  std::size_t eligible{};
+  visitFrom(firstId, [&eligible](std::uint64_t, std::string_view)
+            {
+              ++eligible;
+              return true;
+            });
+  std::size_t skip{eligible > maxEntries ? eligible - maxEntries : 0};
+
+  const std::string tempPath{path + "." + std::to_string(::getpid()) + ".tmp"};
+  const std::string &target{append ? path : tempPath};
+  const int flags{O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC)};
+  UniqueFd fd{::open(target.c_str(), flags, 0600)};
+  if (!fd)
+    return false;
+
+  {
+    OutputBuffer out{fd.get()};
+    visitFrom(firstId, [&](std::uint64_t, std::string_view line)
+              {
+                if (skip > 0)
+                  --skip;
+                else
+                  out.append(line).append('\n');
+                return true;
+              });
+  }
+
+  if (append)
+    return true;
+  if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+  {
+    const int error{errno};
+    ::unlink(tempPath.c_str());
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+HistoryStore::Slot &HistoryStore::slotAt(std::size_t position)
+{
+  return slots[(head + position) % slots.size()];
+}
+
+std::optional<std::size_t> HistoryStore::positionOf(std::uint64_t id)
+{
+  materialize();
+  std::size_t low{0};
+  std::size_t high{count};
+  while (low < high)
+  {
+    const std::size_t middle{low + (high - low) / 2};
+    const std::uint64_t middleId{slotAt(middle).id};
+    if (middleId == id)
+      return slotAt(middle).live ? std::optional<std::size_t>{middle} : std::nullopt;
+    if (middleId < id)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return std::nullopt;
+}
+
+void HistoryStore::materialize()
+{
+  while (pendingFiles > 0)
+  {
+    const MappedFile &file{files[files.size() - pendingFiles]};
+    --pendingFiles;
+    if (capacity == 0)
+      continue;
+
+    const char *begin{file.data()};
+    const char *end{begin + file.size()};
+
+    // With a bounded ring, only the last `capacity` lines can survive, so
+    // find where they start by scanning backwards.
+    const char *start{begin};
+    if (capacity != unlimited)
+    {
+      std::size_t found{};
+      const char *lineEnd{end};
+      while (lineEnd > begin)
+      {
+        const auto *newline{static_cast<const char *>(::memrchr(begin, '\n', static_cast<std::size_t>(lineEnd - begin)))};
+        const char *lineStart{newline ? newline + 1 : begin};
+        if (lineStart != lineEnd && ++found > capacity)
+        {
+          start = lineEnd;
+          break;
+        }
+        if (!newline)
+          break;
+        lineEnd = newline;
+      }
+    }
+
+    if (start == end)
+      continue;
+    const auto length{static_cast<std::size_t>(end - start)};
+    // The buffer holds a reference of its own while its lines are pushed,
+    // so evicting the first of them cannot free it under the loop.
+    const std::uint32_t source{nextSource++};
+    auto &loaded{loadedText[source]};
+    loaded.text = std::make_unique_for_overwrite<char[]>(length);
+    loaded.liveSlots = 1;
+    const char *text{loaded.text.get()};
+    std::memcpy(loaded.text.get(), start, length);
+
+    const char *copyEnd{text + length};
+    for (const char *line{text}; line < copyEnd;)
+    {
+      const auto *newline{static_cast<const char *>(std::memchr(line, '\n', static_cast<std::size_t>(copyEnd - line)))};
+      const char *lineEnd{newline ? newline : copyEnd};
+      if (lineEnd != line)
+        push({line, static_cast<std::size_t>(lineEnd - line)}, line, source);
+      line = lineEnd + 1;
+    }
+    releaseLoaded(source);
+  }
+  files.clear();
+}
+
+void HistoryStore::push(std::string_view line, const char *loaded, std::uint32_t source)
+{
+  if (capacity == 0)
+    return;
+  while (liveCount >= capacity)
+    popFront();
+  if (count == slots.size())
+  {
+    if (count - liveCount > liveCount)
+      compact();
+    else
+      grow();
+  }
+
+  Slot &slot{slots[(head + count) % slots.size()]};
+  slot.id = nextId++;
+  slot.loaded = loaded;
+  slot.length = static_cast<std::uint32_t>(line.size());
+  slot.source = source;
+  if (loaded)
+    ++loadedText[source].liveSlots;
+  else
+    slot.owned.assign(line);
+  slot.live = true;
+  ++count;
+  ++liveCount;
+  if (fingerprintsBuilt)
+    fingerprints.emplace(fingerprint(line), slot.id);
+}
+
+void HistoryStore::popFront()
+{
+  Slot &slot{slots[head]};
+  if (slot.live)
+  {
+    kill(slot);
+    ++evictedLive;
+  }
+  head = (head + 1) % slots.size();
+  --count;
+}
+
+void HistoryStore::kill(Slot &slot)
+{
+  forgetFingerprint(slot);
+  slot.live = false;
+  if (slot.loaded)
+    releaseLoaded(slot.source);
+  slot.loaded = nullptr;
+  std::string{}.swap(slot.owned);
+  --liveCount;
+  ++removed;
+}
+
+void HistoryStore::releaseLoaded(std::uint32_t source)
+{
+  const auto it{loadedText.find(source)};
+  if (it != loadedText.end() && --it->second.liveSlots == 0)
+    loadedText.erase(it);
+}
+
+void HistoryStore::grow()
+{
+  std::vector<Slot> larger(std::max<std::size_t>(16, slots.size() * 2));
+  for (std::size_t i{}; i < count; ++i)
+    larger[i] = std::move(slotAt(i));
+  slots = std::move(larger);
+  head = 0;
+}
+
+void HistoryStore::compact()
+{
+  std::vector<Slot> live(std::max<std::size_t>(16, slots.size()));
+  std::size_t kept{};
+  for (std::size_t i{}; i < count; ++i)
+  {
+    Slot &slot{slotAt(i)};
+    if (slot.live)
+      live[kept++] = std::move(slot);
+  }
+  slots = std::move(live);
+  head = 0;
+  count = kept;
+}
+
+std::uint64_t HistoryStore::fingerprint(std::string_view line)
+{
+  return std::hash<std::string_view>{}(line);
+}
+
+void HistoryStore::forgetFingerprint(const Slot &slot)
+{
+  if (!fingerprintsBuilt)
+    return;
+  const auto range{fingerprints.equal_range(fingerprint(slot.text()))};
+  for (auto it{range.first}; it != range.second; ++it)
+  {
+    if (it->second == slot.id)
+    {
+      fingerprints.erase(it);
+      return;
+    }
+  }
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+// Command history kept in a ring buffer bounded by HISTSIZE. Loading a file
+// only maps it. On first use the part of it the ring can hold is copied
+// into one buffer, and entries read from the file are offsets into that
+// buffer, which is freed once none of them is live; entries added in the
+// session own their text. With a bounded ring
+// only the last `capacity` lines are visited, found by scanning back from
+// the end. The mapping is dropped once copied: a view into it would raise
+// SIGBUS if another process truncated the file.
+//
+// Every entry gets an id, increasing and never reused. Erased entries
+// become tombstones that are compacted away once they outnumber the live
+// ones, so erasing never shifts the ring.
+class HistoryStore
+{
+public:
+  static constexpr std::size_t unlimited{std::numeric_limits<std::size_t>::max()};
+  using Visitor = std::function<bool(std::uint64_t id, std::string_view line)>;
+
+  // Drops the oldest entries beyond `capacity` live entries. Files loaded
+  // but not yet used are read in first, under the old capacity.
+  void setCapacity(std::size_t capacity);
+
+  // Appends the entries of the file at `path`. Returns false with errno set
+  // if it cannot be read; an empty file is not an error.
+  bool load(const std::string &path);
+  void append(std::string_view line);
+  // Erases every live entry equal to `line`, found through a hash of entry
+  // fingerprints instead of a scan. Returns the number erased.
+  std::size_t eraseAll(std::string_view line);
+  void clear();
+
+  std::size_t size();
+  std::uint64_t endId();
+  std::optional<std::string_view> last();
+  std::optional<std::string_view> entry(std::uint64_t id);
+  // Number shown by `history` for a live entry: entries that fell off the
+  // front of the ring keep their numbers, as in bash.
+  std::optional<std::size_t> numberOf(std::uint64_t id);
+  // Ids only grow; a count of entries dropped so far lets indexes over the
+  // ids tell how stale they are.
+  std::size_t removedCount() const;
+
+  // Visit live entries in order from `firstId`, or newest first from the
+  // one before `beforeId`; the visitor returns false to stop.
+  void visitFrom(std::uint64_t firstId, const Visitor &visitor);
+  void visitNewestFirst(const Visitor &visitor, std::uint64_t beforeId = std::numeric_limits<std::uint64_t>::max());
+
+  // Writes the live entries from `firstId` on, one per line, at most the
+  // newest `maxEntries` of them. Replacing a file goes through a temporary
+  // and a rename, so a mapping of the old file (ours or another shell's)
+  // stays valid.
+  bool writeTo(const std::string &path, std::uint64_t firstId, std::size_t maxEntries, bool append);
+
+private:
+  struct Slot
+  {
+    std::uint64_t id{0};
+    std::string owned{};
+    const char *loaded{nullptr};
+    std::uint32_t length{0};
+    // Key of the loadedText buffer `loaded` points into.
+    std::uint32_t source{0};
+    bool live{false};
+
+    std::string_view text() const;
+  };
+
+  std::vector<MappedFile> files{};
+  std::size_t pendingFiles{0};
+  // Loaded lines, one allocation per file; slots point into them, and each
+  // buffer counts the live slots that do.
+  struct LoadedText
+  {
+    std::unique_ptr<char[]> text{};
+    std::size_t liveSlots{0};
+  };
+  std::unordered_map<std::uint32_t, LoadedText> loadedText{};
+  std::uint32_t nextSource{0};
+  std::vector<Slot> slots{};
+  std::size_t head{0};
+  std::size_t count{0};
+  std::size_t liveCount{0};
+  std::size_t capacity{unlimited};
+  std::uint64_t nextId{0};
+  std::size_t evictedLive{0};
+  std::size_t removed{0};
+  // fingerprint -> id; built on the first eraseAll and maintained after.
+  std::unordered_multimap<std::uint64_t, std::uint64_t> fingerprints{};
+  bool fingerprintsBuilt{false};
+
+  Slot &slotAt(std::size_t position);
+  std::optional<std::size_t> positionOf(std::uint64_t id);
+  void materialize();
+  void push(std::string_view line, const char *loaded, std::uint32_t source);
+  void releaseLoaded(std::uint32_t source);
+  void popFront();
+  void kill(Slot &slot);
+  void grow();
+  void compact();
+  static std::uint64_t fingerprint(std::string_view line);
+  void forgetFingerprint(const Slot &slot);
+};
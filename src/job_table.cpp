@@ -0,0 +1,406 @@
+#include "job_table.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <readline/readline.h>
+#include <stdexcept>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "tracer.hpp"
+
+JobTable *JobTable::activeTable{nullptr};
+
+namespace
+{
+  // tcsetpgrp from a process outside the foreground group raises SIGTTOU,
+  // which would stop the shell when it takes the terminal back.
+  void giveTerminalTo(pid_t processGroup)
+  {
+    sigset_t block{};
+    sigset_t previous{};
+    sigemptyset(&block);
+    sigaddset(&block, SIGTTOU);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+    if (tcsetpgrp(STDIN_FILENO, processGroup) != 0)
+      perror("tcsetpgrp");
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+  }
+}
+
+void JobTable::setTerminalControl(bool enabled)
+{
+  terminalControl = enabled;
+}
+
+int JobTable::add(pid_t processGroup, const std::vector<pid_t> &pids, std::string command, OutputBuffer *announce)
+{
+  Job job{};
+  job.id = jobs.empty() ? 1 : jobs.back().id + 1;
+  job.processGroup = processGroup;
+  job.command = std::move(command);
+  job.processes.reserve(pids.size());
+  for (pid_t pid : pids)
+  {
+    Process process{};
+    process.pid = pid;
+    process.pidfd = openPidfd(pid);
+    job.processes.push_back(std::move(process));
+  }
+
+  if (announce)
+    announce->append('[').appendNumber(job.id).append("] ").appendNumber(pids.back()).append('\n');
+
+  jobs.push_back(std::move(job));
+  return jobs.back().id;
+}
+
+void JobTable::reap()
+{
+  for (auto &job : jobs)
+  {
+    for (auto &process : job.processes)
+    {
+      if (process.finished)
+        continue;
+
+      int status{};
+      const pid_t rc{waitpid(process.pid, &status, WNOHANG | WUNTRACED | WCONTINUED)};
+      if (rc == process.pid)
+        collect(process, status);
+      else if (rc < 0 && errno == ECHILD)
+        collect(process, 0);
+    }
+    updateState(job);
+  }
+}
+
+void JobTable::reportChanges(OutputBuffer &out)
+{
+  reap();
+  const Job *current{currentJob()};
+  for (auto &job : jobs)
+  {
+    if (!job.changed)
+      continue;
+    describe(job, &job == current, out);
+    job.changed = false;
+  }
+  std::erase_if(jobs, [](const Job &job)
+                { return job.state == State::Done; });
+}
+
+int JobTable::runJobs(const std::vector<std::string> &, OutputBuffer &out)
+{
+  reap();
+  const Job *current{currentJob()};
+  for (auto &job : jobs)
+  {
+    describe(job, &job == current, out);
+    job.changed = false;
+  }
+  std::erase_if(jobs, [](const Job &job)
+                { return job.state == State::Done; });
+  return 0;
+}
+
+int JobTable::runForeground(const std::vector<std::string> &args, OutputBuffer &out)
+{
+  reap();
+  Job *job{findJob(args, "fg")};
+  if (!job)
+    return 1;
+
+  out.append(job->command).append('\n');
+  out.flush();
+
+  if (terminalControl)
+    giveTerminalTo(job->processGroup);
+  if (job->state == State::Stopped)
+    kill(-job->processGroup, SIGCONT);
+  for (auto &process : job->processes)
+    process.stopped = false;
+  job->state = State::Running;
+
+  const int rc{waitForJob(*job, true)};
+  if (terminalControl)
+    giveTerminalTo(getpgrp());
+
+  if (job->state == State::Stopped)
+  {
+    out.append('\n');
+    describe(*job, true, out);
+    job->changed = false;
+    return rc;
+  }
+
+  forget(*job);
+  return rc;
+}
+
+int JobTable::runBackground(const std::vector<std::string> &args, OutputBuffer &out)
+{
+  reap();
+  Job *job{findJob(args, "bg")};
+  if (!job)
+    return 1;
+
+  if (job->state == State::Done)
+  {
+    std::cerr << "bg: job has terminated\n";
+    return 1;
+  }
+
+  if (kill(-job->processGroup, SIGCONT) != 0)
+  {
+    perror("kill");
+    return 1;
+  }
+  for (auto &process : job->processes)
+    process.stopped = false;
+  job->state = State::Running;
+  job->changed = false;
+
+  out.append('[').appendNumber(job->id).append("]+ ").append(job->command).append(" &\n");
+  return 0;
+}
+
+int JobTable::runWait(const std::vector<std::string> &args)
+{
+  // A stopped job would never finish on its own, so waiting stops at it and
+  // leaves it in the table for fg or bg.
+  if (args.size() < 2)
+  {
+    for (auto &job : jobs)
+      waitForJob(job, true);
+    std::erase_if(jobs, [](const Job &job)
+                  { return job.state != State::Stopped; });
+    return 0;
+  }
+
+  int rc{0};
+  for (std::size_t i{1}; i < args.size(); ++i)
+  {
+    const std::vector<std::string> selector{args[0], args[i]};
+    Job *job{findJob(selector, "wait")};
+    if (!job)
+    {
+      rc = 127;
+      continue;
+    }
+    rc = waitForJob(*job, true);
+    if (job->state != State::Stopped)
+      forget(*job);
+  }
+  return rc;
+}
+
+JobTable::ActiveGuard::ActiveGuard(JobTable &table)
+    : previous{activeTable}
+{
+  activeTable = &table;
+}
+
+JobTable::ActiveGuard::~ActiveGuard()
+{
+  activeTable = previous;
+}
+
+int JobTable::readKey(FILE *stream)
+{
+  while (activeTable)
+  {
+    std::vector<pollfd> fds{{fileno(stream), POLLIN, 0}};
+    for (const auto &job : activeTable->jobs)
+    {
+      for (const auto &process : job.processes)
+      {
+        if (process.pidfd)
+          fds.push_back({process.pidfd.get(), POLLIN, 0});
+      }
+    }
+    if (fds.size() == 1)
+      break;
+
+    // On EINTR readline has a signal to act on; rl_getc handles it.
+    if (poll(fds.data(), fds.size(), -1) < 0 || fds[0].revents != 0)
+      break;
+    activeTable->reap();
+  }
+  return rl_getc(stream);
+}
+
+JobTable::Job *JobTable::findJob(const std::vector<std::string> &args, const char *builtin)
+{
+  if (args.size() < 2)
+  {
+    Job *job{currentJob()};
+    if (!job)
+      std::cerr << builtin << ": current: no such job\n";
+    return job;
+  }
+
+  const std::string &spec{args[1]};
+  if (spec == "%%" || spec == "%+")
+  {
+    Job *job{currentJob()};
+    if (!job)
+      std::cerr << builtin << ": " << spec << ": no such job\n";
+    return job;
+  }
+
+  const bool byId{!spec.empty() && spec[0] == '%'};
+  long value{};
+  try
+  {
+    std::size_t consumed{};
+    const std::string digits{byId ? spec.substr(1) : spec};
+    value = std::stol(digits, &consumed);
+    if (consumed != digits.size())
+      throw std::invalid_argument{digits};
+  }
+  catch (const std::exception &)
+  {
+    std::cerr << builtin << ": " << spec << ": no such job\n";
+    return nullptr;
+  }
+
+  for (auto &job : jobs)
+  {
+    if (byId && job.id == value)
+      return &job;
+    if (!byId && std::any_of(job.processes.begin(), job.processes.end(),
+                             [value](const Process &process)
+                             { return process.pid == value; }))
+      return &job;
+  }
+
+  if (byId)
+    std::cerr << builtin << ": " << spec << ": no such job\n";
+  else
+    std::cerr << builtin << ": pid " << spec << " is not a child of this shell\n";
+  return nullptr;
+}
+
+JobTable::Job *JobTable::currentJob()
+{
+  // The most recently stopped job wins, as it is the likeliest one to be
+  // resumed; otherwise the newest job.
+  for (auto it{jobs.rbegin()}; it != jobs.rend(); ++it)
+  {
+    if (it->state == State::Stopped)
+      return &*it;
+  }
+  return jobs.empty() ? nullptr : &jobs.back();
+}
+
+void JobTable::updateState(Job &job)
+{
+  State state{State::Done};
+  for (const auto &process : job.processes)
+  {
+    if (process.stopped)
+    {
+      state = State::Stopped;
+      break;
+    }
+    if (!process.finished)
+      state = State::Running;
+  }
+
+  if (state != job.state)
+    job.changed = state != State::Running;
+  job.state = state;
+}
+
+int JobTable::waitForJob(Job &job, bool untraced)
+{
+  Tracer::Span span{"JobTable::waitForJob", job.command};
+  for (auto &process : job.processes)
+  {
+    while (!process.finished && !(untraced && process.stopped))
+    {
+      int status{};
+      const pid_t rc{waitpid(process.pid, &status, untraced ? WUNTRACED : 0)};
+      if (rc < 0 && errno == EINTR)
+        continue;
+      collect(process, rc < 0 ? 0 : status);
+    }
+  }
+  updateState(job);
+
+  if (job.state == State::Stopped)
+    return 128 + SIGTSTP;
+  return exitCode(job.processes.back().status);
+}
+
+void JobTable::describe(const Job &job, bool current, OutputBuffer &out) const
+{
+  std::string state{};
+  switch (job.state)
+  {
+  case State::Running:
+    state = "Running";
+    break;
+  case State::Stopped:
+    state = "Stopped";
+    break;
+  case State::Done:
+  {
+    const int status{job.processes.back().status};
+    if (WIFSIGNALED(status))
+      state = strsignal(WTERMSIG(status));
+    else if (WEXITSTATUS(status) != 0)
+      state = "Exit " + std::to_string(WEXITSTATUS(status));
+    else
+      state = "Done";
+    break;
+  }
+  }
+
+  out.append('[').appendNumber(job.id).append(']').append(current ? '+' : ' ').append("  ");
+  out.append(state);
+  if (state.size() < 24)
+    out.append(std::string(24 - state.size(), ' '));
+  out.append(job.command).append('\n');
+}
+
+void JobTable::forget(const Job &job)
+{
+  const int id{job.id};
+  std::erase_if(jobs, [id](const Job &entry)
+                { return entry.id == id; });
+}
+
+void JobTable::collect(Process &process, int status)
+{
+  if (WIFSTOPPED(status))
+  {
+    process.stopped = true;
+    return;
+  }
+  if (WIFCONTINUED(status))
+  {
+    process.stopped = false;
+    return;
+  }
+
+  process.finished = true;
+  process.stopped = false;
+  process.status = status;
+  process.pidfd.reset();
+}
+
+int JobTable::exitCode(int status)
+{
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 127;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#include "fd_utils.hpp"
+#include "output_buffer.hpp"
+
+// Background jobs started with `&`. Every job runs in its own process group
+// and each of its processes is tracked through a pidfd, so the interactive
+// loop can wait on stdin and on job exits in one poll() and reap children as
+// they finish instead of only when the next command runs.
+class JobTable
+{
+public:
+  JobTable() = default;
+
+  JobTable(const JobTable &) = delete;
+  JobTable &operator=(const JobTable &) = delete;
+
+  // When enabled, `fg` hands the terminal to the job's process group.
+  void setTerminalControl(bool enabled);
+
+  int add(pid_t processGroup, const std::vector<pid_t> &pids, std::string command, OutputBuffer *announce);
+  void reap();
+  void reportChanges(OutputBuffer &out);
+
+  int runJobs(const std::vector<std::string> &args, OutputBuffer &out);
+  int runForeground(const std::vector<std::string> &args, OutputBuffer &out);
+  int runBackground(const std::vector<std::string> &args, OutputBuffer &out);
+  int runWait(const std::vector<std::string> &args);
+
+  class ActiveGuard
+  {
+  public:
+    explicit ActiveGuard(JobTable &table);
+    ~ActiveGuard();
+
+    ActiveGuard(const ActiveGuard &) = delete;
+    ActiveGuard &operator=(const ActiveGuard &) = delete;
+
+  private:
+    JobTable *previous{nullptr};
+  };
+
+  // readline getc hook: blocks until a key arrives, reaping any job that
+  // exits in the meantime.
+  static int readKey(FILE *stream);
+
+private:
+  enum class State
+  {
+    Running,
+    Stopped,
+    Done
+  };
+
+  struct Process
+  {
+    pid_t pid{-1};
+    UniqueFd pidfd{};
+    bool finished{false};
+    bool stopped{false};
+    int status{0};
+  };
+
+  struct Job
+  {
+    int id{0};
+    pid_t processGroup{-1};
+    std::vector<Process> processes{};
+    std::string command{};
+    State state{State::Running};
+    bool changed{false};
+  };
+
+  std::vector<Job> jobs{};
+  bool terminalControl{false};
+
+  static JobTable *activeTable;
+
+  Job *findJob(const std::vector<std::string> &args, const char *builtin);
+  Job *currentJob();
+  void updateState(Job &job);
+  int waitForJob(Job &job, bool untraced);
+  void describe(const Job &job, bool current, OutputBuffer &out) const;
+  void forget(const Job &job);
+  static void collect(Process &process, int status);
+  static int exitCode(int status);
+};
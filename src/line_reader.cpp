@@ -0,0 +1,101 @@
+#include "line_reader.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+LineReader::LineReader(int fd)
+    : fd{fd},
+      seekable{::lseek(fd, 0, SEEK_CUR) >= 0}
+{
+}
+
+LineReader::LineReader(UniqueFd ownedFd)
+    : ownedFd{std::move(ownedFd)},
+      fd{this->ownedFd.get()},
+      seekable{::lseek(fd, 0, SEEK_CUR) >= 0}
+{
+}
+
+LineReader::LineReader(std::string_view text)
+    : buffer{text},
+      atEof{true}
+{
+}
+
+bool LineReader::next(std::string &line)
+{
+  if (released)
+    reclaim();
+
+  while (true)
+  {
+    const char *start{buffer.data() + offset};
+    const std::size_t available{buffer.size() - offset};
+    if (const void *newline{std::memchr(start, '\n', available)}; newline)
+    {
+      const std::size_t length{static_cast<std::size_t>(static_cast<const char *>(newline) - start)};
+      line.assign(start, length);
+      offset += length + 1;
+      return true;
+    }
+
+    if (atEof || !fill())
+    {
+      if (offset >= buffer.size())
+        return false;
+      line.assign(buffer, offset);
+      offset = buffer.size();
+      return true;
+    }
+  }
+}
+
+bool LineReader::fill()
+{
+  if (offset > 0)
+  {
+    buffer.erase(0, offset);
+    offset = 0;
+  }
+
+  const std::size_t used{buffer.size()};
+  buffer.resize(used + chunkSize);
+  ssize_t count{};
+  do
+  {
+    count = ::read(fd, buffer.data() + used, chunkSize);
+  } while (count < 0 && errno == EINTR);
+
+  if (count <= 0)
+  {
+    buffer.resize(used);
+    atEof = true;
+    return false;
+  }
+  buffer.resize(used + static_cast<std::size_t>(count));
+  return true;
+}
+
+void LineReader::releaseUnread()
+{
+  if (!seekable || released)
+    return;
+
+  const auto unread{static_cast<off_t>(buffer.size() - offset)};
+  releasedAt = ::lseek(fd, -unread, SEEK_CUR);
+  released = releasedAt >= 0;
+}
+
+void LineReader::reclaim()
+{
+  released = false;
+  const auto unread{static_cast<off_t>(buffer.size() - offset)};
+  if (::lseek(fd, 0, SEEK_CUR) == releasedAt && ::lseek(fd, unread, SEEK_CUR) >= 0)
+    return;
+
+  // Something else read from the descriptor; carry on from where it stopped.
+  buffer.clear();
+  offset = 0;
+  atEof = false;
+}
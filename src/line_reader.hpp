@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+#include "fd_utils.hpp"
+
+// Splits a file descriptor (or an in-memory string) into lines, reading in
+// large chunks rather than a byte or a line at a time.
+class LineReader
+{
+public:
+  explicit LineReader(int fd);
+  explicit LineReader(UniqueFd ownedFd);
+  explicit LineReader(std::string_view text);
+
+  bool next(std::string &line);
+
+  // Seeks a seekable descriptor back to the end of the last line returned,
+  // so a command run next can read the input that follows it. The chunk
+  // already read is kept and reused if the command leaves the offset alone.
+  void releaseUnread();
+
+private:
+  static constexpr std::size_t chunkSize{64 * 1024};
+
+  UniqueFd ownedFd{};
+  int fd{-1};
+  std::string buffer{};
+  std::size_t offset{0};
+  bool atEof{false};
+  bool seekable{false};
+  bool released{false};
+  off_t releasedAt{-1};
+
+  bool fill();
+  void reclaim();
+};
@@ -2,13 +2,16 @@
 
 #include <iostream>
 
+#include "tracer.hpp"
+
 int main(int argc, char *argv[], char **envp)
 {
   // Flush after every std::cout / std::cerr
   std::cout << std::unitbuf;
   std::cerr << std::unitbuf;
 
+  Tracer::startFromEnvironment();
+
   Shell shell{argc, argv, envp};
-  shell.run();
-  return 0;
+  return shell.run();
 }
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fd_utils.hpp"
+
+class MappedFile
+{
+public:
+  MappedFile() = default;
+
+  ~MappedFile()
+  {
+    reset();
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  MappedFile(MappedFile &&other) noexcept
+      : address{other.address},
+        length{other.length}
+  {
+    other.address = nullptr;
+    other.length = 0;
+  }
+
+  MappedFile &operator=(MappedFile &&other) noexcept
+  {
+    if (this != &other)
+    {
+      reset();
+      address = other.address;
+      length = other.length;
+      other.address = nullptr;
+      other.length = 0;
+    }
+    return *this;
+  }
+
+  static MappedFile open(const std::string &path)
+  {
+    MappedFile file{};
+    UniqueFd fd{::open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (!fd)
+      return file;
+
+    struct stat info{};
+    if (::fstat(fd.get(), &info) != 0 || info.st_size <= 0)
+      return file;
+
+    void *mappedAddress{::mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd.get(), 0)};
+    if (mappedAddress == MAP_FAILED)
+      return file;
+
+    file.address = mappedAddress;
+    file.length = static_cast<std::size_t>(info.st_size);
+    return file;
+  }
+
+  const char *data() const
+  {
+    return static_cast<const char *>(address);
+  }
+
+  std::size_t size() const
+  {
+    return length;
+  }
+
+  explicit operator bool() const
+  {
+    return address != nullptr;
+  }
+
+  void reset()
+  {
+    if (address)
+      ::munmap(address, length);
+    address = nullptr;
+    length = 0;
+  }
+
+private:
+  void *address{nullptr};
+  std::size_t length{0};
+};
@@ -0,0 +1,108 @@
+#include "output_buffer.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <sys/uio.h>
+
+OutputBuffer::OutputBuffer(int fd)
+    : fd{fd}
+{
+}
+
+OutputBuffer::OutputBuffer(std::string &capture)
+    : capture{&capture}
+{
+}
+
+OutputBuffer::~OutputBuffer()
+{
+  flush();
+}
+
+OutputBuffer &OutputBuffer::append(std::string_view text)
+{
+  // Large pieces go out together with whatever is buffered in a single
+  // writev, without being copied into the buffer first.
+  if (text.size() >= directWriteThreshold)
+  {
+    writeAll(buffer, text);
+    buffer.clear();
+    return *this;
+  }
+
+  buffer.append(text);
+  if (buffer.size() >= flushThreshold)
+    flush();
+  return *this;
+}
+
+OutputBuffer &OutputBuffer::append(char c)
+{
+  buffer.push_back(c);
+  if (buffer.size() >= flushThreshold)
+    flush();
+  return *this;
+}
+
+OutputBuffer &OutputBuffer::appendNumber(long long value, int width)
+{
+  char digits[24]{};
+  const auto result{std::to_chars(digits, digits + sizeof(digits), value)};
+  const auto length{static_cast<int>(result.ptr - digits)};
+  if (width > length)
+    buffer.append(static_cast<std::size_t>(width - length), ' ');
+  return append(std::string_view{digits, static_cast<std::size_t>(length)});
+}
+
+void OutputBuffer::flush()
+{
+  if (buffer.empty())
+    return;
+  writeAll(buffer, {});
+  buffer.clear();
+}
+
+void OutputBuffer::writeAll(std::string_view head, std::string_view tail)
+{
+  if (capture)
+  {
+    capture->append(head).append(tail);
+    return;
+  }
+
+  iovec parts[2]{{const_cast<char *>(head.data()), head.size()},
+                 {const_cast<char *>(tail.data()), tail.size()}};
+  iovec *current{parts};
+  int count{2};
+
+  while (count > 0)
+  {
+    if (current->iov_len == 0)
+    {
+      ++current;
+      --count;
+      continue;
+    }
+
+    const ssize_t written{::writev(fd, current, count)};
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+
+    auto remaining{static_cast<std::size_t>(written)};
+    while (count > 0 && remaining >= current->iov_len)
+    {
+      remaining -= current->iov_len;
+      ++current;
+      --count;
+    }
+    if (count > 0)
+    {
+      current->iov_base = static_cast<char *>(current->iov_base) + remaining;
+      current->iov_len -= remaining;
+    }
+  }
+}
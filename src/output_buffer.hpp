@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Output sink for builtins. Text is formatted into a reusable buffer and
+// handed to the kernel with one write()/writev() when the command finishes
+// (or when the buffer fills), instead of one small write per item. It writes
+// to whatever the target fd currently refers to, so redirections applied
+// with dup2 are honoured.
+class OutputBuffer
+{
+public:
+  explicit OutputBuffer(int fd);
+  // Collects the output in `capture` instead of writing it anywhere, for
+  // command substitution of builtins.
+  explicit OutputBuffer(std::string &capture);
+  ~OutputBuffer();
+
+  OutputBuffer(const OutputBuffer &) = delete;
+  OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+  OutputBuffer &append(std::string_view text);
+  OutputBuffer &append(char c);
+  OutputBuffer &appendNumber(long long value, int width = 0);
+  void flush();
+
+private:
+  static constexpr std::size_t flushThreshold{64 * 1024};
+  static constexpr std::size_t directWriteThreshold{16 * 1024};
+
+  int fd{-1};
+  std::string *capture{nullptr};
+  std::string buffer{};
+
+  void writeAll(std::string_view head, std::string_view tail);
+};
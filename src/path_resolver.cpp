@@ -1,13 +1,20 @@
 #include "path_resolver.hpp"
 
-#include <cstdlib>
 #include <system_error>
 
+#include "directory_scanner.hpp"
 #include "path_utils.hpp"
+#include "tracer.hpp"
+
+PathResolver::PathResolver(const Environment &environment)
+    : environment{&environment}
+{
+}
 
 bool PathResolver::refresh()
 {
-  const char *pathEnv{std::getenv("PATH")};
+  Tracer::Span span{"PathResolver::refresh"};
+  const char *pathEnv{environment->get("PATH")};
   const std::string pathValue{pathEnv ? pathEnv : ""};
   if (pathValue == cachedPathValue)
     return false;
@@ -17,43 +24,48 @@ bool PathResolver::refresh()
   return true;
 }
 
-std::optional<std::string> PathResolver::findExecutable(const std::string &name) const
+std::optional<std::string> PathResolver::findExecutable(const std::string &name, std::size_t *dirIndex) const
 {
   if (name.empty())
     return std::nullopt;
 
-  for (const auto &dirPath : cachedDirs)
+  Tracer::Span span{"PathResolver::findExecutable", name};
+  for (std::size_t i{}; i < cachedDirs.size(); ++i)
   {
-    const std::filesystem::path candidate{dirPath / name};
-    if (std::filesystem::exists(candidate) && std::filesystem::is_regular_file(candidate) && isExecutable(candidate))
+    const std::filesystem::path candidate{cachedDirs[i] / name};
+    if (isExecutableFile(candidate))
+    {
+      if (dirIndex)
+        *dirIndex = i;
       return candidate.string();
+    }
   }
 
   return std::nullopt;
 }
 
-void PathResolver::forEachExecutable(const std::function<void(const std::filesystem::path &)> &callback) const
+const std::vector<std::filesystem::path> &PathResolver::directories() const
 {
-  for (const auto &dirPath : cachedDirs)
-  {
-    std::error_code ec{};
-    std::filesystem::directory_iterator it{dirPath, ec};
-    if (ec)
-      continue;
+  return cachedDirs;
+}
 
-    for (const auto &entry : it)
-    {
-      if (!entry.is_regular_file(ec))
-      {
-        if (ec)
-          ec.clear();
-        continue;
-      }
-
-      const auto &path{entry.path()};
-      if (isExecutable(path))
-        callback(path);
-    }
+const std::string &PathResolver::pathValue() const
+{
+  return cachedPathValue;
+}
+
+void PathResolver::forEachExecutable(const std::function<void(const std::string &)> &callback) const
+{
+  forEachExecutableIn(cachedDirs, callback);
+}
+
+void PathResolver::forEachExecutableIn(const std::vector<std::filesystem::path> &dirs,
+                                       const std::function<void(const std::string &)> &callback)
+{
+  for (const auto &names : DirectoryScanner{}.scan(dirs))
+  {
+    for (const auto &name : names)
+      callback(name);
   }
 }
 
@@ -84,14 +96,14 @@ std::vector<std::filesystem::path> PathResolver::splitPathValue(const std::strin
   return dirs;
 }
 
-bool PathResolver::isExecutable(const std::filesystem::path &path)
+bool PathResolver::isExecutableFile(const std::filesystem::path &path)
 {
   std::error_code ec{};
-  const auto perms{std::filesystem::status(path, ec).permissions()};
-  if (ec)
+  const auto status{std::filesystem::status(path, ec)};
+  if (ec || !std::filesystem::is_regular_file(status))
     return false;
 
   using std::filesystem::perms;
   const auto mask{perms::owner_exec | perms::group_exec | perms::others_exec};
-  return (perms::none != (perms & mask));
+  return (perms::none != (status.permissions() & mask));
 }
@@ -1,22 +1,33 @@
 #pragma once
 
+#include <cstddef>
 #include <filesystem>
 #include <functional>
 #include <optional>
 #include <string>
 #include <vector>
 
+#include "environment.hpp"
+
 class PathResolver
 {
 public:
+  explicit PathResolver(const Environment &environment);
+
+  // Re-reads PATH; returns true if it changed.
   bool refresh();
-  std::optional<std::string> findExecutable(const std::string &name) const;
-  void forEachExecutable(const std::function<void(const std::filesystem::path &)> &callback) const;
+  std::optional<std::string> findExecutable(const std::string &name, std::size_t *dirIndex = nullptr) const;
+  const std::vector<std::filesystem::path> &directories() const;
+  const std::string &pathValue() const;
+  void forEachExecutable(const std::function<void(const std::string &)> &callback) const;
+  static void forEachExecutableIn(const std::vector<std::filesystem::path> &dirs,
+                                  const std::function<void(const std::string &)> &callback);
 
 private:
+  const Environment *environment{nullptr};
   std::string cachedPathValue{};
   std::vector<std::filesystem::path> cachedDirs{};
 
   static std::vector<std::filesystem::path> splitPathValue(const std::string &pathValue);
-  static bool isExecutable(const std::filesystem::path &path);
+  static bool isExecutableFile(const std::filesystem::path &path);
 };
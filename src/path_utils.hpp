@@ -1,9 +1,25 @@
 #pragma once
 
+#include <ctime>
 #include <filesystem>
 #include <string>
+#include <sys/stat.h>
 
 inline std::filesystem::path normalizePath(const std::string &path)
 {
   return std::filesystem::path{path}.lexically_normal();
 }
+
+// Modification time of a directory, or a zero stamp if it cannot be stat'ed.
+inline timespec directoryStamp(const std::filesystem::path &dir)
+{
+  struct stat info{};
+  if (::stat(dir.c_str(), &info) != 0)
+    return timespec{};
+  return info.st_mtim;
+}
+
+inline bool sameStamp(const timespec &lhs, const timespec &rhs)
+{
+  return lhs.tv_sec == rhs.tv_sec && lhs.tv_nsec == rhs.tv_nsec;
+}
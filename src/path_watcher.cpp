@@ -0,0 +1,115 @@
+#include "path_watcher.hpp"
+
+#include <cerrno>
+#include <cstddef>
+#include <sys/inotify.h>
+#include <unordered_set>
+
+namespace
+{
+  constexpr uint32_t watchMask{IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                               IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR};
+}
+
+void PathWatcher::watch(const std::vector<std::filesystem::path> &dirs)
+{
+  if (!inotifyFd)
+  {
+    inotifyFd.reset(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    if (!inotifyFd)
+      return;
+  }
+
+  // Only directories that joined or left the list are touched: events
+  // already queued for a kept directory must still pass the watches filter
+  // in drain(). Two paths naming one directory share a watch descriptor.
+  std::unordered_map<std::filesystem::path, int> watchedDirs{};
+  for (const auto &entry : watches)
+    watchedDirs.emplace(entry.second, entry.first);
+
+  std::unordered_set<int> keep{};
+  for (const auto &dir : dirs)
+  {
+    if (auto it{watchedDirs.find(dir)}; it != watchedDirs.end())
+    {
+      keep.insert(it->second);
+      continue;
+    }
+    const int wd{inotify_add_watch(inotifyFd.get(), dir.c_str(), watchMask)};
+    if (wd >= 0)
+    {
+      keep.insert(wd);
+      watches.try_emplace(wd, dir);
+    }
+  }
+
+  for (auto it{watches.begin()}; it != watches.end();)
+  {
+    if (keep.contains(it->first))
+    {
+      ++it;
+      continue;
+    }
+    inotify_rm_watch(inotifyFd.get(), it->first);
+    it = watches.erase(it);
+  }
+}
+
+bool PathWatcher::isActive() const
+{
+  return static_cast<bool>(inotifyFd);
+}
+
+bool PathWatcher::drain(const std::function<void(const std::string &name)> &onChange)
+{
+  if (!inotifyFd)
+    return true;
+
+  alignas(inotify_event) char buffer[16 * 1024];
+  std::unordered_set<std::string> changed{};
+  bool trusted{true};
+
+  while (true)
+  {
+    const ssize_t length{::read(inotifyFd.get(), buffer, sizeof(buffer))};
+    if (length < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (length == 0)
+      break;
+
+    for (ssize_t offset{}; offset < length;)
+    {
+      const auto *event{reinterpret_cast<const inotify_event *>(buffer + offset)};
+      offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+      if (event->mask & IN_Q_OVERFLOW)
+      {
+        trusted = false;
+        continue;
+      }
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+      {
+        trusted = false;
+        continue;
+      }
+      if (event->mask & IN_IGNORED)
+      {
+        watches.erase(event->wd);
+        continue;
+      }
+      if (event->len > 0 && watches.count(event->wd))
+        changed.emplace(event->name);
+    }
+  }
+
+  if (!trusted)
+    return false;
+
+  for (const auto &name : changed)
+    onChange(name);
+  return true;
+}
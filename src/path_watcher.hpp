@@ -0,0 +1,27 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "fd_utils.hpp"
+
+class PathWatcher
+{
+public:
+  void watch(const std::vector<std::filesystem::path> &dirs);
+  bool isActive() const;
+
+  // Reports every entry name that was created, removed, renamed or had its
+  // mode changed in a watched directory since the last call. Returns false
+  // when the event stream can no longer be trusted (queue overflow, or a
+  // watched directory was itself removed), in which case the caller should
+  // rebuild from scratch.
+  bool drain(const std::function<void(const std::string &name)> &onChange);
+
+private:
+  UniqueFd inotifyFd{};
+  std::unordered_map<int, std::filesystem::path> watches{};
+};
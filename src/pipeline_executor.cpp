@@ -1,12 +1,80 @@
 #include "pipeline_executor.hpp"
 
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
 
 #include "fd_utils.hpp"
+#include "tracer.hpp"
 
 namespace
 {
+  // Builtin stages share the shell's state, so only one runs at a time. The
+  // threads outlive launch(), so the lock cannot live on its stack.
+  std::mutex inProcessMutex{};
+
+  void runStageInProcess(const ParsedCommand &command,
+                         UniqueFd pipeOutput,
+                         const PipelineExecutor::InProcessRunner &runInProcess,
+                         int &exitCode,
+                         StageUsage &usage)
+  {
+    const auto started{std::chrono::steady_clock::now()};
+
+    // Writing to a pipe whose reader has gone raises SIGPIPE; keep it on
+    // this thread (where it is discarded on exit) instead of letting it
+    // terminate the shell. The write itself then fails with EPIPE.
+    sigset_t pipeSignal{};
+    sigemptyset(&pipeSignal);
+    sigaddset(&pipeSignal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSignal, nullptr);
+
+    UniqueFd output{std::move(pipeOutput)};
+    if (command.stdoutRedir.enabled)
+    {
+      output.reset(ProcessSpawner::openRedirectionFile(command.stdoutRedir, O_CLOEXEC));
+      if (!output)
+      {
+        perror("open");
+        exitCode = 1;
+        return;
+      }
+    }
+
+    {
+      const std::lock_guard lock{inProcessMutex};
+      OutputBuffer out{output ? output.get() : STDOUT_FILENO};
+      exitCode = runInProcess(command, out);
+    }
+
+    usage.wall = std::chrono::steady_clock::now() - started;
+    rusage threadUsage{};
+    if (getrusage(RUSAGE_THREAD, &threadUsage) == 0)
+      usage.assign(threadUsage);
+  }
+
+  int reapStage(pid_t pid, rusage &usage)
+  {
+    int status{};
+    while (wait4(pid, &status, 0, &usage) < 0)
+    {
+      if (errno != EINTR)
+        return 127;
+    }
+    if (WIFEXITED(status))
+      return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+      return 128 + WTERMSIG(status);
+    return 127;
+  }
+
   bool bindPipelineInput(const UniqueFd &prevRead)
   {
     if (!prevRead)
@@ -54,64 +122,267 @@ namespace
   }
 }
 
-int PipelineExecutor::run(const std::vector<ParsedCommand> &commands, const Runner &runner) const
+PipelineExecutor::PipelineExecutor(Environment &environment)
+    : processSpawner{environment}
+{
+}
+
+void PipelineExecutor::setPipeCapacity(std::size_t capacity)
+{
+  pipeCapacity = capacity;
+}
+
+std::vector<int> PipelineExecutor::run(const std::vector<ParsedCommand> &commands,
+                                       const Planner &planStage,
+                                       const Runner &runner,
+                                       const InProcessRunner &runInProcess,
+                                       std::vector<StageUsage> *usage) const
 {
   if (commands.empty())
-    return 0;
+    return {};
+
+  // Plan every stage before any of them starts, so in-process stages never
+  // run concurrently with the lookups done here.
+  std::vector<StagePlan> plans{};
+  plans.reserve(commands.size());
+  for (const auto &command : commands)
+    plans.push_back(planStage(command));
+
+  std::vector<Stage> stages(commands.size());
+  const auto failure{launch(commands, plans, runner, &runInProcess, false, stages)};
+  waitForStages(stages);
+
+  std::vector<int> statuses{};
+  statuses.reserve(stages.size());
+  for (const auto &stage : stages)
+    statuses.push_back(stage.exitCode);
+  if (failure)
+    statuses.back() = *failure;
 
+  if (usage)
+  {
+    for (auto &stage : stages)
+    {
+      stage.usage.exitCode = stage.exitCode;
+      usage->push_back(std::move(stage.usage));
+    }
+  }
+  return statuses;
+}
+
+std::vector<pid_t> PipelineExecutor::runInBackground(const std::vector<ParsedCommand> &commands,
+                                                     const Planner &planStage,
+                                                     const Runner &runner) const
+{
   std::vector<pid_t> pids{};
-  pids.reserve(commands.size());
+  if (commands.empty())
+    return pids;
+
+  std::vector<StagePlan> plans{};
+  plans.reserve(commands.size());
+  for (const auto &command : commands)
+  {
+    plans.push_back(planStage(command));
+    if (plans.back().kind == StagePlan::Kind::InProcess)
+      plans.back().kind = StagePlan::Kind::Forked;
+  }
+
+  std::vector<Stage> stages(commands.size());
+  launch(commands, plans, runner, nullptr, true, stages);
+  for (const auto &stage : stages)
+  {
+    if (stage.pid > 0)
+      pids.push_back(stage.pid);
+  }
+  return pids;
+}
+
+void PipelineExecutor::waitForStages(std::vector<Stage> &stages)
+{
+  // Reap children in the order they exit rather than in pipeline order, so
+  // a stage that finishes early does not linger as a zombie behind a slow
+  // predecessor. Without pidfds, fall back to waiting in order.
+  Tracer::Span span{"PipelineExecutor::waitForStages"};
+  std::vector<UniqueFd> pidfds(stages.size());
+  for (std::size_t i{}; i < stages.size(); ++i)
+  {
+    if (stages[i].pid > 0)
+      pidfds[i] = openPidfd(stages[i].pid);
+  }
+
+  std::vector<pollfd> fds{};
+  std::vector<std::size_t> owners{};
+  while (true)
+  {
+    fds.clear();
+    owners.clear();
+    for (std::size_t i{}; i < pidfds.size(); ++i)
+    {
+      if (!pidfds[i])
+        continue;
+      fds.push_back({pidfds[i].get(), POLLIN, 0});
+      owners.push_back(i);
+    }
+    if (fds.empty())
+      break;
+
+    if (poll(fds.data(), fds.size(), -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (std::size_t j{}; j < fds.size(); ++j)
+    {
+      if (fds[j].revents == 0)
+        continue;
+      Stage &stage{stages[owners[j]]};
+      finishStage(stage);
+      pidfds[owners[j]].reset();
+    }
+  }
+
+  for (auto &stage : stages)
+  {
+    if (stage.pid > 0)
+      finishStage(stage);
+    if (stage.thread.joinable())
+      stage.thread.join();
+  }
+}
+
+void PipelineExecutor::finishStage(Stage &stage)
+{
+  rusage childUsage{};
+  stage.exitCode = reapStage(stage.pid, childUsage);
+  stage.usage.wall = std::chrono::steady_clock::now() - stage.started;
+  if (stage.spawnPeakKb >= 0)
+    stage.usage.assignSpawned(childUsage, stage.spawnPeakKb);
+  else
+    stage.usage.assign(childUsage);
+  stage.pid = -1;
+}
+
+std::optional<int> PipelineExecutor::launch(const std::vector<ParsedCommand> &commands,
+                                            const std::vector<StagePlan> &plans,
+                                            const Runner &runner,
+                                            const InProcessRunner *runInProcess,
+                                            bool background,
+                                            std::vector<Stage> &stages) const
+{
+  pid_t processGroup{background ? 0 : -1};
+
+  // Builtin stages only start once every process stage has been forked or
+  // spawned. The builtins may touch shell state (the command hash, the
+  // history store, the tracer's lock), and a child forked while a thread is
+  // halfway through changing it would inherit that state broken.
+  std::vector<std::pair<std::size_t, UniqueFd>> threadStages{};
+  auto startThreads{[&]
+                    {
+                      for (auto &[index, output] : threadStages)
+                        stages[index].thread = std::jthread{runStageInProcess, std::cref(commands[index]),
+                                                            std::move(output), std::cref(*runInProcess),
+                                                            std::ref(stages[index].exitCode),
+                                                            std::ref(stages[index].usage)};
+                    }};
 
   UniqueFd prevRead{};
   for (std::size_t i{}; i < commands.size(); ++i)
   {
     PipeFds pipeFds{};
     const bool hasNext{i + 1 < commands.size()};
-    if (hasNext && !PipeFds::create(pipeFds))
+    if (hasNext && !PipeFds::create(pipeFds, pipeCapacity))
     {
       perror("pipe");
+      startThreads();
       return 1;
     }
 
-    pid_t pid{fork()};
+    const bool shouldPipeOutput{hasNext && !commands[i].stdoutRedir.enabled};
+    stages[i].started = std::chrono::steady_clock::now();
+    stages[i].usage.name = commands[i].args.empty() ? std::string{} : commands[i].args[0];
+    if (plans[i].kind == StagePlan::Kind::External)
+    {
+      SpawnIo io{};
+      io.stdinFd = prevRead.get();
+      io.stdoutFd = shouldPipeOutput ? pipeFds.write.get() : -1;
+      io.closeFds = {prevRead.get(), pipeFds.read.get(), pipeFds.write.get()};
+      io.processGroup = processGroup;
+      stages[i].spawnPeakKb = StageUsage::shellPeakKb();
+      stages[i].pid = processSpawner.spawn(plans[i].path, commands[i].args, commands[i].stdoutRedir,
+                                           commands[i].stderrRedir, io);
+      if (stages[i].pid < 0)
+        stages[i].exitCode = 127;
+      else if (processGroup == 0)
+        processGroup = stages[i].pid;
+      advanceParentPipe(prevRead, pipeFds, hasNext);
+      continue;
+    }
+
+    if (plans[i].kind == StagePlan::Kind::InProcess && runInProcess)
+    {
+      // The builtin never reads its input, so drop the read end now; an
+      // upstream writer then sees EPIPE instead of filling a pipe forever.
+      prevRead.reset();
+      UniqueFd output{};
+      if (shouldPipeOutput)
+        output = std::move(pipeFds.write);
+      pipeFds.write.reset();
+      threadStages.emplace_back(i, std::move(output));
+      if (hasNext)
+        prevRead = std::move(pipeFds.read);
+      continue;
+    }
+
+    pid_t pid{-1};
+    {
+      Tracer::Span span{"fork", stages[i].usage.name};
+      pid = fork();
+    }
     if (pid == 0)
     {
+      if (processGroup >= 0)
+        setpgid(0, processGroup);
+
       if (!bindPipelineInput(prevRead))
         _exit(127);
 
-      const bool shouldPipeOutput{hasNext && !commands[i].stdoutRedir.enabled};
       if (!bindPipelineOutput(pipeFds, shouldPipeOutput))
         _exit(127);
 
       closeChildPipes(prevRead, pipeFds, hasNext);
 
-      int rc{runner(commands[i], ExecMode::Child)};
+      int rc{};
+      {
+        Tracer::Span span{"stage", stages[i].usage.name};
+        rc = runner(commands[i], ExecMode::Child);
+      }
+      Tracer::flush();
       _exit(rc);
     }
     else if (pid > 0)
     {
-      pids.push_back(pid);
+      // Set the group from both sides so it is in place whichever of
+      // parent and child runs first.
+      if (processGroup >= 0)
+      {
+        setpgid(pid, processGroup == 0 ? pid : processGroup);
+        if (processGroup == 0)
+          processGroup = pid;
+      }
+      stages[i].pid = pid;
       advanceParentPipe(prevRead, pipeFds, hasNext);
     }
     else
     {
       perror("fork");
       closeChildPipes(prevRead, pipeFds, hasNext);
+      startThreads();
       return 127;
     }
   }
 
-  if (prevRead)
-    prevRead.reset();
-
-  int lastStatus{0};
-  for (std::size_t i{}; i < pids.size(); ++i)
-  {
-    int status{};
-    waitpid(pids[i], &status, 0);
-    if (i + 1 == pids.size())
-      lastStatus = status;
-  }
-
-  return WIFEXITED(lastStatus) ? WEXITSTATUS(lastStatus) : 127;
+  startThreads();
+  return std::nullopt;
 }
@@ -1,14 +1,83 @@
 #pragma once
 
+#include <chrono>
+#include <cstddef>
 #include <functional>
+#include <optional>
+#include <string>
+#include <sys/types.h>
+#include <thread>
 #include <vector>
 
 #include "command.hpp"
+#include "output_buffer.hpp"
+#include "process_spawner.hpp"
+#include "time_report.hpp"
 
 class PipelineExecutor
 {
 public:
+  // How a stage is started: external commands are spawned, builtins that
+  // only produce output run on a thread inside the shell, and anything else
+  // (state-changing builtins, unknown commands) is forked and handed to the
+  // Runner.
+  struct StagePlan
+  {
+    enum class Kind
+    {
+      External,
+      InProcess,
+      Forked
+    };
+
+    Kind kind{Kind::Forked};
+    std::string path{};
+  };
+
   using Runner = std::function<int(const ParsedCommand &, ExecMode)>;
+  using Planner = std::function<StagePlan(const ParsedCommand &)>;
+  using InProcessRunner = std::function<int(const ParsedCommand &, OutputBuffer &)>;
+
+  explicit PipelineExecutor(Environment &environment);
+
+  void setPipeCapacity(std::size_t capacity);
+
+  // Runs the pipeline to completion and returns every stage's exit code, in
+  // pipeline order; a signalled stage reports 128 + the signal number. With
+  // `usage`, each stage's wall time and rusage are appended to it as well.
+  std::vector<int> run(const std::vector<ParsedCommand> &commands,
+                       const Planner &planStage,
+                       const Runner &runner,
+                       const InProcessRunner &runInProcess,
+                       std::vector<StageUsage> *usage = nullptr) const;
+
+  // Starts every stage in a child process, all in one new process group,
+  // and returns their pids without waiting. Empty if nothing could start.
+  std::vector<pid_t> runInBackground(const std::vector<ParsedCommand> &commands,
+                                     const Planner &planStage,
+                                     const Runner &runner) const;
+
+private:
+  struct Stage
+  {
+    pid_t pid{-1};
+    std::jthread thread{};
+    int exitCode{0};
+    std::chrono::steady_clock::time_point started{};
+    // Shell's peak RSS when a spawned stage started; -1 for forked stages.
+    long spawnPeakKb{-1};
+    StageUsage usage{};
+  };
+
+  ProcessSpawner processSpawner;
+  std::size_t pipeCapacity{0};
 
-  int run(const std::vector<ParsedCommand> &commands, const Runner &runner) const;
+  std::optional<int> launch(const std::vector<ParsedCommand> &commands,
+                            const std::vector<StagePlan> &plans,
+                            const Runner &runner,
+                            const InProcessRunner *runInProcess,
+                            bool background,
+                            std::vector<Stage> &stages) const;
+  static void waitForStages(std::vector<Stage> &stages);
+  static void finishStage(Stage &stage);
 };
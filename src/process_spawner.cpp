@@ -0,0 +1,134 @@
+#include "process_spawner.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <spawn.h>
+#include <unistd.h>
+
+#include "fd_utils.hpp"
+#include "path_utils.hpp"
+#include "tracer.hpp"
+
+namespace
+{
+  class FileActions
+  {
+  public:
+    FileActions()
+    {
+      posix_spawn_file_actions_init(&actions);
+    }
+
+    ~FileActions()
+    {
+      posix_spawn_file_actions_destroy(&actions);
+    }
+
+    FileActions(const FileActions &) = delete;
+    FileActions &operator=(const FileActions &) = delete;
+
+    void dup2(int fd, int targetFd)
+    {
+      if (fd >= 0 && fd != targetFd)
+        posix_spawn_file_actions_adddup2(&actions, fd, targetFd);
+    }
+
+    void close(int fd)
+    {
+      if (fd > STDERR_FILENO)
+        posix_spawn_file_actions_addclose(&actions, fd);
+    }
+
+    const posix_spawn_file_actions_t *get() const
+    {
+      return &actions;
+    }
+
+  private:
+    posix_spawn_file_actions_t actions{};
+  };
+}
+
+ProcessSpawner::ProcessSpawner(Environment &environment)
+    : environment{&environment}
+{
+}
+
+pid_t ProcessSpawner::spawn(const std::string &path,
+                            const std::vector<std::string> &args,
+                            const OutputRedirection &stdoutRedir,
+                            const OutputRedirection &stderrRedir,
+                            const SpawnIo &io) const
+{
+  UniqueFd stdoutFile{};
+  UniqueFd stderrFile{};
+  if (stdoutRedir.enabled)
+  {
+    stdoutFile.reset(openRedirectionFile(stdoutRedir, O_CLOEXEC));
+    if (!stdoutFile)
+    {
+      perror("open");
+      return -1;
+    }
+  }
+  if (stderrRedir.enabled)
+  {
+    stderrFile.reset(openRedirectionFile(stderrRedir, O_CLOEXEC));
+    if (!stderrFile)
+    {
+      perror("open");
+      return -1;
+    }
+  }
+
+  FileActions actions{};
+  actions.dup2(io.stdinFd, STDIN_FILENO);
+  actions.dup2(io.stdoutFd, STDOUT_FILENO);
+  actions.dup2(stdoutFile.get(), STDOUT_FILENO);
+  actions.dup2(stderrFile.get(), STDERR_FILENO);
+  for (int fd : io.closeFds)
+    actions.close(fd);
+
+  posix_spawnattr_t attributes{};
+  posix_spawnattr_init(&attributes);
+  if (io.processGroup >= 0)
+  {
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, io.processGroup);
+  }
+
+  std::vector<char *> execArgv{buildArgv(args)};
+  pid_t pid{-1};
+  Tracer::Span span{"posix_spawn", path};
+  const int rc{posix_spawn(&pid, path.c_str(), actions.get(), &attributes, execArgv.data(), environment->envp())};
+  posix_spawnattr_destroy(&attributes);
+  if (rc != 0)
+  {
+    std::fprintf(stderr, "execve: %s\n", std::strerror(rc));
+    return -1;
+  }
+  return pid;
+}
+
+std::vector<char *> ProcessSpawner::buildArgv(const std::vector<std::string> &parts)
+{
+  std::vector<char *> execArgv{};
+  execArgv.reserve(parts.size() + 1);
+  std::transform(parts.begin(), parts.end(), std::back_inserter(execArgv),
+                 [](const std::string &part)
+                 { return const_cast<char *>(part.c_str()); });
+  execArgv.push_back(nullptr);
+
+  return execArgv;
+}
+
+int ProcessSpawner::openRedirectionFile(const OutputRedirection &redir, int extraFlags)
+{
+  const std::string targetPath{normalizePath(redir.file).string()};
+  return open(targetPath.c_str(),
+              O_WRONLY | O_CREAT | (redir.append ? O_APPEND : O_TRUNC) | extraFlags,
+              0644);
+}
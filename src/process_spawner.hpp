@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#include "command.hpp"
+#include "environment.hpp"
+
+struct SpawnIo
+{
+  int stdinFd{-1};
+  int stdoutFd{-1};
+  std::vector<int> closeFds{};
+  // -1 keeps the shell's process group, 0 starts a new group led by the
+  // child, anything else joins that group.
+  pid_t processGroup{-1};
+};
+
+class ProcessSpawner
+{
+public:
+  explicit ProcessSpawner(Environment &environment);
+
+  // Starts `path` without copying the shell's address space (glibc's
+  // posix_spawn runs the child on clone(CLONE_VM | CLONE_VFORK)). Pipe ends
+  // and redirections are applied as spawn file actions. Returns the child
+  // pid, or -1 after reporting the error.
+  pid_t spawn(const std::string &path,
+              const std::vector<std::string> &args,
+              const OutputRedirection &stdoutRedir,
+              const OutputRedirection &stderrRedir,
+              const SpawnIo &io = {}) const;
+
+  static std::vector<char *> buildArgv(const std::vector<std::string> &parts);
+  static int openRedirectionFile(const OutputRedirection &redir, int extraFlags = 0);
+
+private:
+  Environment *environment{nullptr};
+};
@@ -0,0 +1,136 @@
+#include "shared_history_file.hpp"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fd_utils.hpp"
+
+namespace
+{
+  bool lock(int fd, int operation)
+  {
+    while (::flock(fd, operation) != 0)
+    {
+      if (errno != EINTR)
+        return false;
+    }
+    return true;
+  }
+}
+
+void SharedHistoryFile::attach(const std::string &path)
+{
+  filePath = path;
+  struct stat info{};
+  if (::stat(path.c_str(), &info) != 0)
+  {
+    offset = 0;
+    device = 0;
+    inode = 0;
+    return;
+  }
+  offset = static_cast<std::uint64_t>(info.st_size);
+  device = info.st_dev;
+  inode = info.st_ino;
+}
+
+const std::string &SharedHistoryFile::path() const
+{
+  return filePath;
+}
+
+bool SharedHistoryFile::pull(const Sink &sink)
+{
+  UniqueFd fd{::open(filePath.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (!fd)
+    return errno == ENOENT;
+  if (!lock(fd.get(), LOCK_SH))
+    return false;
+  return readNew(fd.get(), sink);
+}
+
+bool SharedHistoryFile::append(const std::vector<std::string_view> &lines, const Sink &sink)
+{
+  UniqueFd fd{::open(filePath.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)};
+  if (!fd || !lock(fd.get(), LOCK_EX) || !readNew(fd.get(), sink))
+    return false;
+
+  std::string record{};
+  for (const std::string_view line : lines)
+  {
+    record.append(line);
+    record.push_back('\n');
+  }
+  std::string_view pending{record};
+  while (!pending.empty())
+  {
+    const ssize_t written{::write(fd.get(), pending.data(), pending.size())};
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    pending.remove_prefix(static_cast<std::size_t>(written));
+  }
+  offset += record.size();
+  return true;
+}
+
+bool SharedHistoryFile::readNew(int fd, const Sink &sink)
+{
+  struct stat info{};
+  if (::fstat(fd, &info) != 0)
+    return false;
+
+  const auto size{static_cast<std::uint64_t>(info.st_size)};
+  if (info.st_dev != device || info.st_ino != inode)
+  {
+    // A file that appeared since attach() is read from the start; one that
+    // replaced the file we followed holds a rewrite of entries we have.
+    offset = inode == 0 ? 0 : size;
+    device = info.st_dev;
+    inode = info.st_ino;
+  }
+  if (size <= offset)
+  {
+    offset = size;
+    return true;
+  }
+
+  std::string pending(static_cast<std::size_t>(size - offset), '\0');
+  std::size_t filled{0};
+  while (filled < pending.size())
+  {
+    const ssize_t got{::pread(fd, pending.data() + filled, pending.size() - filled,
+                              static_cast<off_t>(offset + filled))};
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0)
+      return false;
+    if (got == 0)
+      break;
+    filled += static_cast<std::size_t>(got);
+  }
+
+  // A line without its newline is still being written; leave it for the
+  // next pull.
+  const std::string_view text{pending.data(), filled};
+  const std::size_t lastNewline{text.rfind('\n')};
+  if (lastNewline == std::string_view::npos)
+    return true;
+
+  std::size_t start{0};
+  while (start <= lastNewline)
+  {
+    const std::size_t end{text.find('\n', start)};
+    if (end > start)
+      sink(text.substr(start, end - start));
+    start = end + 1;
+  }
+  offset += lastNewline + 1;
+  return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+// A history file shared by several concurrent shells. Each session appends
+// its entries as they are entered, under an exclusive flock, and picks up
+// the other sessions' entries by reading only the bytes past the offset it
+// has already seen. A file replaced by a rename (history -w in any session)
+// has a new inode; the reader then skips to its end instead of re-reading
+// entries it already holds.
+class SharedHistoryFile
+{
+public:
+  using Sink = std::function<void(std::string_view line)>;
+
+  // Starts following `path` from its current end.
+  void attach(const std::string &path);
+  const std::string &path() const;
+
+  // Passes the complete lines other sessions appended since the last call
+  // to `sink`. Returns false with errno set if the file cannot be read; a
+  // missing file is not an error.
+  bool pull(const Sink &sink);
+  // Pulls like pull(), then appends `lines`, all under one exclusive lock
+  // so the order of the file matches the order seen here.
+  bool append(const std::vector<std::string_view> &lines, const Sink &sink);
+
+private:
+  std::string filePath{};
+  std::uint64_t offset{0};
+  dev_t device{0};
+  ino_t inode{0};
+
+  bool readNew(int fd, const Sink &sink);
+};
@@ -1,6 +1,8 @@
 #include "shell.hpp"
 
 #include <algorithm>
+#include <cctype>
+#include <chrono>
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
@@ -8,79 +10,155 @@
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <stdexcept>
 #include <readline/readline.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
 #include <utility>
 
 #include "fd_utils.hpp"
 #include "path_utils.hpp"
+#include "tracer.hpp"
+
+namespace
+{
+  void readAll(int fd, std::string &out)
+  {
+    char chunk[4096];
+    while (true)
+    {
+      const ssize_t got{::read(fd, chunk, sizeof(chunk))};
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= 0)
+        return;
+      out.append(chunk, static_cast<std::size_t>(got));
+    }
+  }
+}
 
 Shell::Shell(int argc, char *argvInput[], char **envpInput)
-    : historyManager{static_cast<int>(::getpid())}
+    : environment{envpInput},
+      pathResolver{environment},
+      completionEngine{environment},
+      pipelineExecutor{environment},
+      processSpawner{environment},
+      historyManager{static_cast<int>(::getpid()), environment}
 {
   this->argv.reserve(static_cast<std::size_t>(argc));
   std::transform(argvInput, argvInput + argc, std::back_inserter(this->argv),
                  [](char *arg)
                  { return std::string{arg ? arg : ""}; });
 
-  if (envpInput)
+  parseArguments();
+  if (interactive)
   {
-    char **envEnd{envpInput};
-    while (*envEnd)
-      ++envEnd;
-    this->envp.reserve(static_cast<std::size_t>(envEnd - envpInput));
-    std::transform(envpInput, envEnd, std::back_inserter(this->envp),
-                   [](char *entry)
-                   { return std::string{entry ? entry : ""}; });
+    historyManager.loadFromEnv();
+    jobTable.setTerminalControl(true);
   }
+  for (const auto &[name, enable] : startupOptions)
+    setOption(name, enable);
 
-  historyManager.loadFromEnv();
-
-  registerBuiltin("exit", [this](const auto &)
+  registerBuiltin("exit", [this](const auto &, auto &)
                   {
-    historyManager.saveToEnv();
+    if (interactive)
+      historyManager.saveToEnv();
     std::exit(0);
     return 0; });
 
-  registerBuiltin("echo", [](const auto &args)
+  registerBuiltin("echo", [](const auto &args, auto &out)
                   {
     for (std::size_t i{1}; i < args.size(); ++i)
     {
       if (i > 1)
-        std::cout << ' ';
-      std::cout << args[i];
+        out.append(' ');
+      out.append(args[i]);
     }
-    std::cout << "\n";
+    out.append('\n');
     return 0; });
 
-  registerBuiltin("type", [this](const auto &args)
-                  { return runType(args); });
+  registerBuiltin("type", [this](const auto &args, auto &out)
+                  { return runType(args, out); });
 
-  registerBuiltin("pwd", [this](const auto &)
-                  { return runPwd(); });
+  registerBuiltin("pwd", [this](const auto &, auto &out)
+                  { return runPwd(out); });
 
-  registerBuiltin("cd", [this](const auto &args)
+  registerBuiltin("cd", [this](const auto &args, auto &)
                   { return runCd(args); });
 
-  registerBuiltin("history", [this](const auto &args)
-                  { return historyManager.runHistory(args); });
+  registerBuiltin("history", [this](const auto &args, auto &out)
+                  { return historyManager.runHistory(args, out); });
+
+  registerBuiltin("hash", [this](const auto &args, auto &out)
+                  { return commandHash.runHash(args, pathResolver, out); });
+
+  registerBuiltin("set", [this](const auto &args, auto &out)
+                  { return runSet(args, out); });
+
+  registerBuiltin("jobs", [this](const auto &args, auto &out)
+                  { return jobTable.runJobs(args, out); });
 
-  completionEngine.refreshExecutables();
+  registerBuiltin("fg", [this](const auto &args, auto &out)
+                  { return jobTable.runForeground(args, out); });
+
+  registerBuiltin("bg", [this](const auto &args, auto &out)
+                  { return jobTable.runBackground(args, out); });
+
+  registerBuiltin("wait", [this](const auto &args, auto &)
+                  { return jobTable.runWait(args); });
+  registerBuiltin("export", [this](const auto &args, auto &out)
+                  { return runExport(args, out); });
+  registerBuiltin("unset", [this](const auto &args, auto &)
+                  { return runUnset(args); });
+
+  if (interactive)
+    completionEngine.refreshExecutables();
 }
 
-void Shell::registerBuiltin(const std::string &name, CommandHandler handler)
+void Shell::parseArguments()
 {
-  commands[name] = std::move(handler);
-  completionEngine.registerBuiltin(name);
+  auto missingArgument{[this](const std::string &option)
+                       {
+                         std::cerr << argv[0] << ": " << option << ": option requires an argument\n";
+                         argumentError = true;
+                       }};
+
+  std::size_t next{1};
+  while (next < argv.size() && (argv[next] == "-o" || argv[next] == "+o"))
+  {
+    if (next + 1 == argv.size())
+    {
+      missingArgument(argv[next]);
+      return;
+    }
+    startupOptions.emplace_back(argv[next + 1], argv[next] == "-o");
+    next += 2;
+  }
+
+  if (argv.size() > next && argv[next] == "-c")
+  {
+    if (next + 1 == argv.size())
+    {
+      missingArgument(argv[next]);
+      return;
+    }
+    commandString = argv[next + 1];
+    return;
+  }
+  if (argv.size() > next)
+  {
+    scriptPath = argv[next];
+    return;
+  }
+  interactive = ::isatty(STDIN_FILENO) != 0;
 }
 
-int Shell::openRedirectionFile(const OutputRedirection &redir) const
+void Shell::registerBuiltin(const std::string &name, CommandHandler handler)
 {
-  const std::string targetPath{normalizePath(redir.file).string()};
-  return open(targetPath.c_str(),
-              O_WRONLY | O_CREAT | (redir.append ? O_APPEND : O_TRUNC),
-              0644);
+  commands[name] = std::move(handler);
+  completionEngine.registerBuiltin(name);
 }
 
 bool Shell::applyRedirection(const OutputRedirection &redir, int targetFd, int *savedFd)
@@ -98,7 +176,7 @@ bool Shell::applyRedirection(const OutputRedirection &redir, int targetFd, int *
     }
   }
 
-  UniqueFd fileFd{openRedirectionFile(redir)};
+  UniqueFd fileFd{ProcessSpawner::openRedirectionFile(redir)};
   if (!fileFd)
   {
     perror("open");
@@ -133,28 +211,29 @@ void Shell::restoreFd(int targetFd, int &savedFd)
   savedFd = -1;
 }
 
-bool Shell::parseCommandTokens(const std::vector<std::string> &parts, ParsedCommand &command, bool allowEmpty)
+bool Shell::parseCommandTokens(const std::vector<Word> &parts, ParsedCommand &command, bool allowEmpty)
 {
+  Tracer::Span span{"Shell::parseCommandTokens"};
   command = ParsedCommand{};
   command.args.reserve(parts.size());
   for (std::size_t i{}; i < parts.size(); ++i)
   {
-    const std::string &token{parts[i]};
+    const Word &token{parts[i]};
     bool append{false};
     OutputRedirection *target{nullptr};
 
-    if (token == ">" || token == "1>")
+    if (token.isBare(">") || token.isBare("1>"))
       target = &command.stdoutRedir;
-    else if (token == ">>" || token == "1>>")
+    else if (token.isBare(">>") || token.isBare("1>>"))
     {
       target = &command.stdoutRedir;
       append = true;
     }
-    else if (token == "2>")
+    else if (token.isBare("2>"))
     {
       target = &command.stderrRedir;
     }
-    else if (token == "2>>")
+    else if (token.isBare("2>>"))
     {
       target = &command.stderrRedir;
       append = true;
@@ -169,12 +248,12 @@ bool Shell::parseCommandTokens(const std::vector<std::string> &parts, ParsedComm
       }
       target->enabled = true;
       target->append = append;
-      target->file = parts[i + 1];
+      target->file = parts[i + 1].text;
       ++i;
       continue;
     }
 
-    command.args.push_back(token);
+    command.args.push_back(token.text);
   }
 
   if (command.args.empty())
@@ -188,13 +267,13 @@ bool Shell::parseCommandTokens(const std::vector<std::string> &parts, ParsedComm
   return true;
 }
 
-std::vector<std::vector<std::string>> Shell::splitPipeline(const std::vector<std::string> &parts) const
+std::vector<std::vector<Word>> Shell::splitPipeline(const std::vector<Word> &parts) const
 {
-  std::vector<std::vector<std::string>> segments{};
+  std::vector<std::vector<Word>> segments{};
   segments.emplace_back();
   for (const auto &token : parts)
   {
-    if (token == "|")
+    if (token.isBare("|"))
     {
       segments.emplace_back();
       continue;
@@ -213,7 +292,11 @@ int Shell::executeCommand(const ParsedCommand &command, ExecMode mode)
   if (cmd != commands.end())
   {
     if (mode == ExecMode::Parent && !command.stdoutRedir.enabled && !command.stderrRedir.enabled)
-      return cmd->second(command.args);
+    {
+      int rc{cmd->second(command.args, builtinOutput)};
+      builtinOutput.flush();
+      return rc;
+    }
 
     int savedStdout{-1};
     int savedStderr{-1};
@@ -229,7 +312,8 @@ int Shell::executeCommand(const ParsedCommand &command, ExecMode mode)
       return 1;
     }
 
-    int rc{cmd->second(command.args)};
+    int rc{cmd->second(command.args, builtinOutput)};
+    builtinOutput.flush();
     if (mode == ExecMode::Parent)
     {
       restoreFd(STDERR_FILENO, savedStderr);
@@ -252,15 +336,276 @@ int Shell::executeCommand(const ParsedCommand &command, ExecMode mode)
 
 int Shell::runPipeline(const std::vector<ParsedCommand> &commands)
 {
-  return pipelineExecutor.run(commands,
-                              [this](const ParsedCommand &command, ExecMode mode)
-                              { return executeCommand(command, mode); });
+  return recordStatus(pipelineExecutor.run(commands,
+                                           [this](const ParsedCommand &command)
+                                           { return planStage(command); },
+                                           [this](const ParsedCommand &command, ExecMode mode)
+                                           { return executeCommand(command, mode); },
+                                           [this](const ParsedCommand &command, OutputBuffer &out)
+                                           { return runInProcess(command, out); },
+                                           timedStages));
 }
 
-int Shell::runCommand(const std::vector<std::string> &parts)
+int Shell::recordStatus(std::vector<int> statuses)
+{
+  // PIPESTATUS is a shell variable, as in bash: children only see it after
+  // `export PIPESTATUS`.
+  if (statuses.empty())
+    statuses.push_back(0);
+
+  std::string text{};
+  for (int status : statuses)
+  {
+    if (!text.empty())
+      text.push_back(' ');
+    text += std::to_string(status);
+  }
+  environment.assign("PIPESTATUS", text);
+  pipeStatus = std::move(statuses);
+
+  if (options.pipefail)
+  {
+    const auto failed{std::find_if(pipeStatus.rbegin(), pipeStatus.rend(),
+                                   [](int status)
+                                   { return status != 0; })};
+    if (failed != pipeStatus.rend())
+      return *failed;
+  }
+  return pipeStatus.back();
+}
+
+PipelineExecutor::StagePlan Shell::planStage(const ParsedCommand &command)
+{
+  using Kind = PipelineExecutor::StagePlan::Kind;
+  if (command.args.empty())
+    return {Kind::Forked, {}};
+
+  if (commands.find(command.args[0]) != commands.end())
+    return {runsInProcess(command) ? Kind::InProcess : Kind::Forked, {}};
+
+  if (auto path{findExecutable(command.args[0])}; path)
+    return {Kind::External, *path};
+  return {Kind::Forked, {}};
+}
+
+bool Shell::runsInProcess(const ParsedCommand &command) const
+{
+  // Only builtins that merely report state may share the shell's process;
+  // anything that changes it (cd, exit, history -c, hash -r, ...) keeps
+  // the subshell semantics of a forked child. Errors go to the shell's own
+  // stderr, so a stderr redirection also needs a child.
+  if (command.stderrRedir.enabled)
+    return false;
+
+  const std::string &name{command.args[0]};
+  if (name == "echo" || name == "pwd" || name == "type")
+    return true;
+  if (name == "history")
+    return command.args.size() == 1 || command.args[1].empty() || command.args[1][0] != '-';
+  if (name == "hash" || name == "export")
+    return command.args.size() == 1;
+  return false;
+}
+
+int Shell::runInProcess(const ParsedCommand &command, OutputBuffer &out)
+{
+  return commands.at(command.args[0])(command.args, out);
+}
+
+std::string Shell::substitute(const std::string &command)
+{
+  Tracer::Span span{"Shell::substitute", command};
+  const auto words{tokenizer.tokenize(command)};
+  if (words.empty())
+    return {};
+
+  // Builtins that only report state write straight into a string. A line
+  // that also runs programs keeps the shell in this process and points its
+  // stdout at a pipe for the duration; only builtins that change the
+  // shell's state (and `&` or `time`) need a forked subshell.
+  using Kind = PipelineExecutor::StagePlan::Kind;
+  bool subshell{words.front().isBare("time") || std::any_of(words.begin(), words.end(), [](const Word &word)
+                                                               { return word.isBare("&") || word.isBare("&&"); })};
+  bool inMemory{!subshell};
+  std::vector<ParsedCommand> stages{};
+  std::vector<Word> parts{};
+  if (!subshell)
+  {
+    parts = expandWords(words);
+    if (parts.empty())
+      return {};
+    for (const auto &segment : splitPipeline(parts))
+    {
+      ParsedCommand stage{};
+      if (!parseCommandTokens(segment, stage, false))
+        return {};
+      const Kind kind{planStage(stage).kind};
+      inMemory = inMemory && kind == Kind::InProcess && !stage.stdoutRedir.enabled;
+      subshell = subshell || kind == Kind::Forked;
+      stages.push_back(std::move(stage));
+    }
+  }
+
+  std::string captured{};
+  if (inMemory)
+  {
+    // Builtins never read stdin, so only the last stage's output survives.
+    std::vector<int> statuses{};
+    for (const auto &stage : stages)
+    {
+      captured.clear();
+      OutputBuffer out{captured};
+      statuses.push_back(runInProcess(stage, out));
+    }
+    recordStatus(std::move(statuses));
+    return captured;
+  }
+
+  PipeFds pipeFds{};
+  if (!PipeFds::create(pipeFds))
+  {
+    perror("pipe");
+    return {};
+  }
+  builtinOutput.flush();
+  int savedStdout{dup(STDOUT_FILENO)};
+  if (savedStdout < 0 || dup2(pipeFds.write.get(), STDOUT_FILENO) < 0)
+  {
+    perror("dup2");
+    if (savedStdout >= 0)
+      close(savedStdout);
+    return {};
+  }
+  pipeFds.write.reset();
+
+  {
+    // Drained concurrently so output larger than the pipe cannot stall the
+    // command; the reader sees EOF once stdout is restored and every child
+    // has exited.
+    std::jthread reader{[&]
+                        { readAll(pipeFds.read.get(), captured); }};
+    if (!subshell)
+      runForeground(parts);
+    else
+    {
+      const pid_t pid{fork()};
+      if (pid == 0)
+      {
+        const int rc{runCommand(words)};
+        builtinOutput.flush();
+        Tracer::flush();
+        std::_Exit(rc);
+      }
+      if (pid < 0)
+        perror("fork");
+      int status{};
+      while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR)
+      {
+      }
+      if (pid > 0)
+        recordStatus({WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status)});
+    }
+    builtinOutput.flush();
+    restoreFd(STDOUT_FILENO, savedStdout);
+  }
+  return captured;
+}
+
+int Shell::runCommand(const std::vector<Word> &words)
+{
+  Tracer::Span span{"Shell::runCommand", words.empty() ? std::string_view{} : std::string_view{words.front().text}};
+  // Every list ended by `&` becomes a background job; whatever follows the
+  // last `&` runs in the foreground. Each list's substitutions run just
+  // before it does, so they see the effects of the lists before them.
+  if (std::any_of(words.begin(), words.end(), [](const Word &word)
+                  { return word.isBare("&&"); }))
+  {
+    std::cerr << "syntax error: `&&' is not supported\n";
+    return 2;
+  }
+
+  std::vector<Word> list{};
+  for (const auto &word : words)
+  {
+    if (!word.isBare("&"))
+    {
+      list.push_back(word);
+      continue;
+    }
+    if (int rc{runBackground(expandWords(list))}; rc != 0)
+      return rc;
+    list.clear();
+  }
+  return runForeground(expandWords(list));
+}
+
+std::vector<Word> Shell::expandWords(const std::vector<Word> &words)
+{
+  std::vector<Word> expanded{};
+  expanded.reserve(words.size());
+  for (const auto &word : words)
+  {
+    if (word.substitutions.empty())
+    {
+      expanded.push_back(word);
+      continue;
+    }
+
+    // Quoted output stays inside the word. Unquoted output is split on
+    // whitespace into fields, the first joining the text before it and the
+    // last the text after it. Fields are literal: `|` or `>` in a command's
+    // output is never read as an operator. A word that expands to nothing
+    // unquoted disappears.
+    Word field{};
+    field.literal = true;
+    bool started{word.literal};
+    std::size_t copied{0};
+    for (const auto &substitution : word.substitutions)
+    {
+      started = started || substitution.offset > copied;
+      field.text.append(word.text, copied, substitution.offset - copied);
+      copied = substitution.offset;
+
+      std::string output{substitute(substitution.command)};
+      while (!output.empty() && output.back() == '\n')
+        output.pop_back();
+      if (substitution.quoted)
+      {
+        field.text += output;
+        started = true;
+        continue;
+      }
+      for (const char c : output)
+      {
+        if (!std::isspace(static_cast<unsigned char>(c)))
+        {
+          field.text.push_back(c);
+          started = true;
+          continue;
+        }
+        if (started)
+        {
+          expanded.push_back(std::move(field));
+          field = Word{};
+          field.literal = true;
+          started = false;
+        }
+      }
+    }
+    started = started || copied < word.text.size();
+    field.text.append(word.text, copied);
+    if (started)
+      expanded.push_back(std::move(field));
+  }
+  return expanded;
+}
+
+int Shell::runForeground(const std::vector<Word> &parts)
 {
   if (parts.empty())
     return 0;
+  if (parts.front().isBare("time"))
+    return runTimed({parts.begin() + 1, parts.end()});
 
   auto segments{splitPipeline(parts)};
   if (segments.size() > 1)
@@ -280,19 +625,73 @@ int Shell::runCommand(const std::vector<std::string> &parts)
   ParsedCommand command{};
   if (!parseCommandTokens(parts, command, true))
     return 1;
-  return executeCommand(command, ExecMode::Parent);
+  if (!timedStages || command.args.empty())
+    return recordStatus({executeCommand(command, ExecMode::Parent)});
+
+  // externalCommand reports a spawned child itself; anything that ran in
+  // the shell is charged with the shell's own usage over the call.
+  const std::size_t reported{timedStages->size()};
+  const auto started{std::chrono::steady_clock::now()};
+  rusage before{};
+  getrusage(RUSAGE_SELF, &before);
+  const int rc{executeCommand(command, ExecMode::Parent)};
+  if (timedStages->size() == reported)
+  {
+    rusage after{};
+    getrusage(RUSAGE_SELF, &after);
+    StageUsage usage{};
+    usage.name = command.args[0];
+    usage.exitCode = rc;
+    usage.wall = std::chrono::steady_clock::now() - started;
+    usage.assign(before, after);
+    timedStages->push_back(std::move(usage));
+  }
+  return recordStatus({rc});
+}
+
+int Shell::runTimed(const std::vector<Word> &parts)
+{
+  std::vector<StageUsage> stages{};
+  std::vector<StageUsage> *outer{std::exchange(timedStages, &stages)};
+  const auto started{std::chrono::steady_clock::now()};
+  const int rc{runForeground(parts)};
+  const auto wall{std::chrono::steady_clock::now() - started};
+  timedStages = outer;
+
+  OutputBuffer report{STDERR_FILENO};
+  TimeReport::write(stages, wall, options.timeFormat, report);
+  return rc;
 }
 
-std::vector<char *> Shell::argvHelper(const std::vector<std::string> &parts)
+int Shell::runBackground(const std::vector<Word> &parts)
 {
-  std::vector<char *> execArgv{};
-  execArgv.reserve(parts.size() + 1);
-  std::transform(parts.begin(), parts.end(), std::back_inserter(execArgv),
-                 [](const std::string &part)
-                 { return const_cast<char *>(part.c_str()); });
-  execArgv.push_back(nullptr);
+  std::vector<ParsedCommand> parsed{};
+  std::string text{};
+  for (const auto &segment : splitPipeline(parts))
+  {
+    ParsedCommand command{};
+    if (!parseCommandTokens(segment, command, false))
+      return 1;
+    parsed.push_back(std::move(command));
+  }
+  for (const auto &word : parts)
+  {
+    if (!text.empty())
+      text.push_back(' ');
+    text += word.text;
+  }
+
+  const auto pids{pipelineExecutor.runInBackground(parsed,
+                                                   [this](const ParsedCommand &command)
+                                                   { return planStage(command); },
+                                                   [this](const ParsedCommand &command, ExecMode mode)
+                                                   { return executeCommand(command, mode); })};
+  if (pids.empty())
+    return 1;
 
-  return execArgv;
+  jobTable.add(pids.front(), pids, std::move(text), interactive ? &builtinOutput : nullptr);
+  builtinOutput.flush();
+  return 0;
 }
 
 int Shell::execExternal(const std::string &path,
@@ -305,9 +704,9 @@ int Shell::execExternal(const std::string &path,
   if (!applyRedirection(stderrRedir, STDERR_FILENO, nullptr))
     return 127;
 
-  std::vector<char *> execArgv{argvHelper(parts)};
-  extern char **environ;
-  execve(path.c_str(), execArgv.data(), environ);
+  std::vector<char *> execArgv{ProcessSpawner::buildArgv(parts)};
+  Tracer::flush();
+  execve(path.c_str(), execArgv.data(), environment.envp());
   perror("execve");
   return 127;
 }
@@ -317,27 +716,39 @@ int Shell::externalCommand(const std::string &path,
                            const OutputRedirection &stdoutRedir,
                            const OutputRedirection &stderrRedir)
 {
+  const auto started{std::chrono::steady_clock::now()};
+  const long shellPeakKb{timedStages ? StageUsage::shellPeakKb() : 0};
+  const pid_t pid{processSpawner.spawn(path, parts, stdoutRedir, stderrRedir)};
+  if (pid < 0)
+    return 127;
 
-  pid_t pid{fork()};
-  if (pid == 0)
-  {
-    int rc{execExternal(path, parts, stdoutRedir, stderrRedir)};
-    _exit(rc);
-  }
-  else if (pid > 0)
+  int status{};
+  rusage childUsage{};
   {
-    int status{};
-    waitpid(pid, &status, 0);
-    return WIFEXITED(status) ? WEXITSTATUS(status) : 127;
+    Tracer::Span span{"wait", parts.empty() ? path : parts[0]};
+    while (wait4(pid, &status, 0, &childUsage) < 0)
+    {
+      if (errno != EINTR)
+        return 127;
+    }
   }
-  else
+  int rc{WIFEXITED(status) ? WEXITSTATUS(status) : 127};
+  if (WIFSIGNALED(status))
+    rc = 128 + WTERMSIG(status);
+
+  if (timedStages)
   {
-    perror("fork");
-    return 127;
+    StageUsage usage{};
+    usage.name = parts.empty() ? path : parts[0];
+    usage.exitCode = rc;
+    usage.wall = std::chrono::steady_clock::now() - started;
+    usage.assignSpawned(childUsage, shellPeakKb);
+    timedStages->push_back(std::move(usage));
   }
+  return rc;
 }
 
-int Shell::runType(const std::vector<std::string> &args)
+int Shell::runType(const std::vector<std::string> &args, OutputBuffer &out)
 {
   if (args.size() < 2)
     return 0;
@@ -348,34 +759,28 @@ int Shell::runType(const std::vector<std::string> &args)
 
     if (commands.find(name) != commands.end())
     {
-      std::cout << name << " is a shell builtin\n";
+      out.append(name).append(" is a shell builtin\n");
       continue;
     }
 
     auto path{findExecutable(name)};
     if (path)
     {
-      std::cout << name << " is " << *path << "\n";
+      out.append(name).append(" is ").append(*path).append('\n');
       continue;
     }
 
-    std::cout << name << ": not found\n";
+    out.append(name).append(": not found\n");
   }
 
   return 0;
 }
 
-int Shell::runPwd()
+int Shell::runPwd(OutputBuffer &out)
 {
-  if (const char *pwd{std::getenv("PWD")}; pwd && *pwd)
-  {
-    std::cout << pwd << "\n";
-    return 0;
-  }
-
-  if (auto pwd{getEnvValue("PWD")}; pwd)
+  if (const char *pwd{environment.get("PWD")}; pwd && *pwd)
   {
-    std::cout << *pwd << "\n";
+    out.append(pwd).append('\n');
     return 0;
   }
 
@@ -388,7 +793,7 @@ int Shell::runCd(const std::vector<std::string> &args)
   std::string target{};
   if (args.size() < 2)
   {
-    const char *home{std::getenv("HOME")};
+    const char *home{environment.get("HOME")};
     if (!home || *home == '\0')
     {
       std::cerr << "cd: HOME not set\n";
@@ -405,7 +810,7 @@ int Shell::runCd(const std::vector<std::string> &args)
   {
     if (target.size() == 1 || target[1] == '/')
     {
-      const char *home{std::getenv("HOME")};
+      const char *home{environment.get("HOME")};
       if (!home || *home == '\0')
       {
         std::cerr << "cd: HOME not set\n";
@@ -416,8 +821,8 @@ int Shell::runCd(const std::vector<std::string> &args)
   }
 
   std::optional<std::string> oldPwd{getCurrentDir()};
-  if (!oldPwd)
-    oldPwd = getEnvValue("PWD");
+  if (const char *pwd{environment.get("PWD")}; !oldPwd && pwd)
+    oldPwd = pwd;
 
   const std::string normalizedTarget{normalizePath(target).string()};
   if (chdir(normalizedTarget.c_str()) != 0)
@@ -433,43 +838,186 @@ int Shell::runCd(const std::vector<std::string> &args)
     newPwd = target;
 
   if (oldPwd)
-    setEnvValue("OLDPWD", *oldPwd);
-  setEnvValue("PWD", newPwd);
+    environment.set("OLDPWD", *oldPwd);
+  environment.set("PWD", newPwd);
   return 0;
 }
 
-std::optional<std::string> Shell::findExecutable(const std::string &name)
+int Shell::runExport(const std::vector<std::string> &args, OutputBuffer &out)
 {
-  pathResolver.refresh();
-  return pathResolver.findExecutable(name);
+  if (args.size() <= 1 || (args.size() == 2 && args[1] == "-p"))
+  {
+    for (std::string_view entry : environment.sortedEntries())
+    {
+      const std::size_t separator{entry.find('=')};
+      out.append("export ").append(entry.substr(0, separator)).append("=\"");
+      for (char c : entry.substr(separator + 1))
+      {
+        if (c == '"' || c == '\\' || c == '$' || c == '`')
+          out.append('\\');
+        out.append(c);
+      }
+      out.append("\"\n");
+    }
+    return 0;
+  }
+
+  // `export NAME` without a value exports a shell variable such as
+  // PIPESTATUS; an environment variable is exported already.
+  int rc{0};
+  for (std::size_t i{1}; i < args.size(); ++i)
+  {
+    const std::size_t separator{args[i].find('=')};
+    const std::string name{args[i].substr(0, separator)};
+    if (!Environment::isValidName(name))
+    {
+      std::cerr << "export: `" << args[i] << "': not a valid identifier\n";
+      rc = 1;
+      continue;
+    }
+    if (separator != std::string::npos)
+      environment.set(name, std::string_view{args[i]}.substr(separator + 1));
+    else
+      environment.exportVariable(name);
+  }
+  return rc;
 }
 
-std::optional<std::string> Shell::getEnvValue(const std::string &key) const
+int Shell::runUnset(const std::vector<std::string> &args)
 {
-  const std::string prefix{key + "="};
-  auto it{std::find_if(envp.begin(), envp.end(),
-                       [&prefix](const std::string &entry)
-                       { return entry.compare(0, prefix.size(), prefix) == 0; })};
-  if (it != envp.end())
-    return it->substr(prefix.size());
-  return std::nullopt;
+  int rc{0};
+  for (std::size_t i{1}; i < args.size(); ++i)
+  {
+    if (!Environment::isValidName(args[i]))
+    {
+      std::cerr << "unset: `" << args[i] << "': not a valid identifier\n";
+      rc = 1;
+      continue;
+    }
+    environment.unset(args[i]);
+  }
+  return rc;
 }
 
-void Shell::setEnvValue(const std::string &key, const std::string &value)
+int Shell::runSet(const std::vector<std::string> &args, OutputBuffer &out)
 {
-  const std::string prefix{key + "="};
-  auto it{std::find_if(envp.begin(), envp.end(),
-                       [&prefix](const std::string &entry)
-                       { return entry.compare(0, prefix.size(), prefix) == 0; })};
-  if (it != envp.end())
+  if (args.size() <= 1 || (args.size() == 2 && args[1] == "-o"))
   {
-    *it = prefix + value;
-    setenv(key.c_str(), value.c_str(), 1);
-    return;
+    out.append("fuzzycomplete\t").append(options.fuzzyComplete ? "on\n" : "off\n");
+    out.append("pipefail\t").append(options.pipefail ? "on\n" : "off\n");
+    out.append("pipesize\t");
+    if (options.pipeSize == 0)
+      out.append("default\n");
+    else
+      out.appendNumber(static_cast<long long>(options.pipeSize)).append('\n');
+    out.append("sharehistory\t").append(options.shareHistory ? "on\n" : "off\n");
+    out.append("timeformat\t").append(options.timeFormat == TimeReport::Format::Json ? "json\n" : "text\n");
+    return 0;
+  }
+
+  if (args[1] != "-o" && args[1] != "+o")
+  {
+    std::cerr << "set: " << args[1] << ": invalid option\n";
+    return 1;
+  }
+
+  const bool enable{args[1] == "-o"};
+  int rc{0};
+  for (std::size_t i{2}; i < args.size(); ++i)
+    rc |= setOption(args[i], enable);
+  return rc;
+}
+
+int Shell::setOption(const std::string &assignment, bool enable)
+{
+  const std::size_t separator{assignment.find('=')};
+  const std::string name{assignment.substr(0, separator)};
+  if (name == "pipefail" && separator == std::string::npos)
+  {
+    options.pipefail = enable;
+    return 0;
+  }
+  if (name == "fuzzycomplete" && separator == std::string::npos)
+  {
+    options.fuzzyComplete = enable;
+    completionEngine.setFuzzyMatching(enable ? &historyManager.commandUsage() : nullptr);
+    return 0;
+  }
+  if (name == "sharehistory" && separator == std::string::npos)
+  {
+    options.shareHistory = enable;
+    historyManager.setShareHistory(enable);
+    return 0;
+  }
+  if (name == "timeformat")
+  {
+    const std::string value{separator == std::string::npos ? "" : assignment.substr(separator + 1)};
+    if (!enable || value == "text")
+      options.timeFormat = TimeReport::Format::Text;
+    else if (value == "json")
+      options.timeFormat = TimeReport::Format::Json;
+    else
+    {
+      std::cerr << "set: " << name << ": " << value << ": expected text or json\n";
+      return 1;
+    }
+    return 0;
+  }
+  if (name != "pipesize")
+  {
+    std::cerr << "set: " << name << ": invalid option name\n";
+    return 1;
+  }
+  if (!enable)
+  {
+    options.pipeSize = 0;
+    pipelineExecutor.setPipeCapacity(0);
+    return 0;
+  }
+
+  const std::string value{separator == std::string::npos ? "" : assignment.substr(separator + 1)};
+  std::size_t requested{};
+  try
+  {
+    std::size_t consumed{};
+    requested = std::stoul(value, &consumed);
+    if (consumed != value.size() || value.starts_with('-'))
+      throw std::invalid_argument{value};
+  }
+  catch (const std::exception &)
+  {
+    std::cerr << "set: " << name << ": " << value << ": numeric argument required\n";
+    return 1;
+  }
+  if (const std::size_t maxCapacity{PipeFds::maxCapacity()}; requested > maxCapacity)
+  {
+    std::cerr << "set: " << name << ": " << value << ": out of range (at most " << maxCapacity << " bytes)\n";
+    return 1;
   }
 
-  envp.push_back(prefix + value);
-  setenv(key.c_str(), value.c_str(), 1);
+  std::size_t granted{0};
+  if (requested > 0)
+  {
+    granted = PipeFds::grantedCapacity(requested);
+    if (granted == 0)
+    {
+      std::cerr << "set: " << name << ": cannot resize pipes to " << requested << " bytes\n";
+      return 1;
+    }
+    if (granted != requested)
+      std::cerr << "set: " << name << ": requested " << requested << " bytes, granted " << granted << "\n";
+  }
+
+  options.pipeSize = granted;
+  pipelineExecutor.setPipeCapacity(granted);
+  return 0;
+}
+
+std::optional<std::string> Shell::findExecutable(const std::string &name)
+{
+  if (pathResolver.refresh())
+    commandHash.clear();
+  return commandHash.lookup(name, pathResolver);
 }
 
 std::optional<std::string> Shell::getCurrentDir() const
@@ -482,17 +1030,135 @@ std::optional<std::string> Shell::getCurrentDir() const
   return result;
 }
 
-void Shell::run()
+int Shell::run()
+{
+  if (argumentError)
+    return 2;
+  if (commandString)
+  {
+    LineReader reader{std::string_view{*commandString}};
+    return runLines(reader, true);
+  }
+  if (scriptPath)
+    return runScript(*scriptPath);
+  if (!interactive)
+  {
+    LineReader reader{STDIN_FILENO};
+    return runLines(reader, false);
+  }
+
+  runInteractive();
+  return 0;
+}
+
+int Shell::runScript(const std::string &path)
+{
+  UniqueFd fd{::open(normalizePath(path).c_str(), O_RDONLY | O_CLOEXEC)};
+  if (!fd)
+  {
+    std::cerr << argv[0] << ": " << path << ": " << std::strerror(errno) << "\n";
+    return 127;
+  }
+
+  LineReader reader{std::move(fd)};
+  return runLines(reader, false);
+}
+
+int Shell::runLines(LineReader &reader, bool execLastCommand)
+{
+  std::string line{};
+  std::vector<Word> pending{};
+  bool hasPending{false};
+  bool continuing{false};
+  int status{0};
+
+  while (reader.next(line))
+  {
+    if (continuing)
+      tokenizer.feed("\n");
+    tokenizer.feed(line);
+
+    continuing = tokenizer.needsMoreInput();
+    if (continuing)
+      continue;
+
+    auto parts{tokenizer.takeTokens()};
+    if (parts.empty())
+      continue;
+
+    if (!execLastCommand)
+    {
+      reader.releaseUnread();
+      status = runCommand(parts);
+      jobTable.reap();
+      continue;
+    }
+
+    // Hold one command back so the final one can be recognised and exec'd
+    // in place instead of forked and waited on.
+    if (hasPending)
+    {
+      status = runCommand(pending);
+      jobTable.reap();
+    }
+    pending = std::move(parts);
+    hasPending = true;
+  }
+
+  if (continuing)
+  {
+    tokenizer.reset();
+    if (hasPending)
+      status = runCommand(pending);
+    std::cerr << "syntax error: unexpected end of file\n";
+    return 2;
+  }
+
+  if (!hasPending)
+    return status;
+
+  const bool hasBackgroundJob{std::any_of(pending.begin(), pending.end(), [](const Word &word)
+                                          { return word.isBare("&") || word.isBare("&&"); })};
+  if (execLastCommand && !hasBackgroundJob)
+  {
+    // `time` has to outlive its command to report on it, and pipelines
+    // need the shell to wire their stages, so neither is exec'd in place.
+    const auto words{expandWords(pending)};
+    if (words.empty() || words.front().isBare("time") || splitPipeline(words).size() > 1)
+      return runForeground(words);
+
+    ParsedCommand command{};
+    if (!parseCommandTokens(words, command, true))
+      return 1;
+    if (command.args.empty())
+      return 0;
+    return executeCommand(command, ExecMode::Child);
+  }
+  return runCommand(pending);
+}
+
+void Shell::runInteractive()
 {
   CompletionEngine::ActiveGuard completionGuard{completionEngine};
+  JobTable::ActiveGuard jobGuard{jobTable};
+  HistoryManager::ActiveGuard historyGuard{historyManager};
   rl_initialize();
   rl_bind_key('\t', &CompletionEngine::handleTab);
+  HistoryManager::bindKeys();
+  rl_getc_function = &JobTable::readKey;
 
   std::string buffer{};
   bool awaitingContinuation{false};
 
   while (true)
   {
+    if (!awaitingContinuation)
+    {
+      jobTable.reportChanges(builtinOutput);
+      builtinOutput.flush();
+      historyManager.mergeSharedHistory();
+    }
+
     const char *prompt{awaitingContinuation ? "> " : "$ "};
     std::unique_ptr<char, decltype(&std::free)> input{readline(prompt), &std::free};
     if (!input)
@@ -501,6 +1167,7 @@ void Shell::run()
       {
         std::cerr << "syntax error: unexpected end of file\n";
         buffer.clear();
+        tokenizer.reset();
         awaitingContinuation = false;
         continue;
       }
@@ -510,18 +1177,19 @@ void Shell::run()
 
     std::string line{input.get()};
 
-    if (!buffer.empty())
+    if (awaitingContinuation)
+    {
       buffer.push_back('\n');
+      tokenizer.feed("\n");
+    }
     buffer += line;
+    tokenizer.feed(line);
 
-    const auto parts{tokenizer.tokenize(buffer)};
-    if (!parts.empty() && parts.back() == "|")
-    {
-      awaitingContinuation = true;
+    awaitingContinuation = tokenizer.needsMoreInput();
+    if (awaitingContinuation)
       continue;
-    }
 
-    awaitingContinuation = false;
+    const auto parts{tokenizer.takeTokens()};
     if (!buffer.empty())
       historyManager.addEntry(buffer);
     runCommand(parts);
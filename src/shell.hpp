@@ -3,21 +3,31 @@
 #include <functional>
 #include <optional>
 #include <string>
+#include <unistd.h>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "command.hpp"
+#include "command_hash.hpp"
 #include "completion_engine.hpp"
+#include "environment.hpp"
 #include "history_manager.hpp"
+#include "job_table.hpp"
+#include "line_reader.hpp"
+#include "output_buffer.hpp"
 #include "pipeline_executor.hpp"
+#include "process_spawner.hpp"
 #include "path_resolver.hpp"
+#include "shell_options.hpp"
+#include "time_report.hpp"
 #include "tokenizer.hpp"
 
 class Shell
 {
 public:
   Shell(int argc, char *argvInput[], char **envpInput);
-  void run();
+  int run();
 
   ~Shell() = default;
   Shell(const Shell &) = delete;
@@ -26,34 +36,62 @@ public:
   Shell &operator=(Shell &&) noexcept = delete;
 
 private:
-  using CommandHandler = std::function<int(const std::vector<std::string> &)>;
+  using CommandHandler = std::function<int(const std::vector<std::string> &, OutputBuffer &)>;
 
   std::vector<std::string> argv{};
-  std::vector<std::string> envp{};
+  Environment environment;
+  std::optional<std::string> commandString{};
+  std::optional<std::string> scriptPath{};
+  bool interactive{false};
+  // Set when the command line is malformed; run() then exits with status 2.
+  bool argumentError{false};
+  ShellOptions options{};
+  // `-o name` / `+o name` pairs given before the command or script.
+  std::vector<std::pair<std::string, bool>> startupOptions{};
+  std::vector<int> pipeStatus{0};
+  // Set while a command runs under `time`; collects per-stage usage.
+  std::vector<StageUsage> *timedStages{nullptr};
   std::unordered_map<std::string, CommandHandler> commands;
-  PathResolver pathResolver{};
+  PathResolver pathResolver;
+  CommandHash commandHash{};
   CompletionEngine completionEngine;
-  PipelineExecutor pipelineExecutor{};
+  PipelineExecutor pipelineExecutor;
+  ProcessSpawner processSpawner;
   Tokenizer tokenizer{};
   HistoryManager historyManager;
+  JobTable jobTable{};
+  OutputBuffer builtinOutput{STDOUT_FILENO};
 
+  void parseArguments();
   void registerBuiltin(const std::string &name, CommandHandler handler);
-  int runCommand(const std::vector<std::string> &parts);
-  bool parseCommandTokens(const std::vector<std::string> &parts, ParsedCommand &command, bool allowEmpty);
-  std::vector<std::vector<std::string>> splitPipeline(const std::vector<std::string> &parts) const;
+  void runInteractive();
+  int runScript(const std::string &path);
+  int runLines(LineReader &reader, bool execLastCommand);
+  int runCommand(const std::vector<Word> &words);
+  int runForeground(const std::vector<Word> &parts);
+  int runTimed(const std::vector<Word> &parts);
+  int runBackground(const std::vector<Word> &parts);
+  bool parseCommandTokens(const std::vector<Word> &parts, ParsedCommand &command, bool allowEmpty);
+  std::vector<std::vector<Word>> splitPipeline(const std::vector<Word> &parts) const;
   int executeCommand(const ParsedCommand &command, ExecMode mode);
   int runPipeline(const std::vector<ParsedCommand> &commands);
-  int runType(const std::vector<std::string> &args);
-  int runPwd();
+  PipelineExecutor::StagePlan planStage(const ParsedCommand &command);
+  bool runsInProcess(const ParsedCommand &command) const;
+  int runInProcess(const ParsedCommand &command, OutputBuffer &out);
+  std::vector<Word> expandWords(const std::vector<Word> &words);
+  std::string substitute(const std::string &command);
+  int runType(const std::vector<std::string> &args, OutputBuffer &out);
+  int runPwd(OutputBuffer &out);
   int runCd(const std::vector<std::string> &args);
-  int openRedirectionFile(const OutputRedirection &redir) const;
+  int runSet(const std::vector<std::string> &args, OutputBuffer &out);
+  int runExport(const std::vector<std::string> &args, OutputBuffer &out);
+  int runUnset(const std::vector<std::string> &args);
+  int setOption(const std::string &assignment, bool enable);
+  int recordStatus(std::vector<int> statuses);
   bool applyRedirection(const OutputRedirection &redir, int targetFd, int *savedFd);
   void restoreFd(int targetFd, int &savedFd);
-  std::optional<std::string> getEnvValue(const std::string &key) const;
-  void setEnvValue(const std::string &key, const std::string &value);
   std::optional<std::string> getCurrentDir() const;
   std::optional<std::string> findExecutable(const std::string &name);
-  std::vector<char *> argvHelper(const std::vector<std::string> &parts);
   int execExternal(const std::string &path,
                    const std::vector<std::string> &parts,
                    const OutputRedirection &stdoutRedir,
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+#include "time_report.hpp"
+
+// Settings changed at runtime with the `set` builtin.
+struct ShellOptions
+{
+  // Pipe capacity in bytes for pipeline stages; 0 keeps the kernel default.
+  std::size_t pipeSize{0};
+  // A pipeline's status is that of its last failing stage, not its last.
+  bool pipefail{false};
+  // Append history entries to HISTFILE as they are entered and merge in
+  // those of other sessions sharing it.
+  bool shareHistory{false};
+  // Complete command names by fuzzy match ranked by usage in history.
+  bool fuzzyComplete{false};
+  // Output format of the `time` keyword.
+  TimeReport::Format timeFormat{TimeReport::Format::Text};
+};
@@ -0,0 +1,173 @@
+#include "time_report.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <string_view>
+
+namespace
+{
+  std::chrono::microseconds toMicroseconds(const timeval &value)
+  {
+    return std::chrono::seconds{value.tv_sec} + std::chrono::microseconds{value.tv_usec};
+  }
+
+  void appendSeconds(OutputBuffer &out, std::chrono::nanoseconds duration, int width = 0)
+  {
+    char digits[32]{};
+    const double seconds{std::chrono::duration<double>{duration}.count()};
+    const auto result{std::to_chars(digits, digits + sizeof(digits), seconds, std::chars_format::fixed, 3)};
+    const auto length{static_cast<int>(result.ptr - digits)};
+    if (width > length)
+      out.append(std::string(static_cast<std::size_t>(width - length), ' '));
+    out.append(std::string_view{digits, static_cast<std::size_t>(length)});
+  }
+
+  void appendJsonString(OutputBuffer &out, std::string_view text)
+  {
+    static constexpr char hex[]{"0123456789abcdef"};
+    out.append('"');
+    for (char c : text)
+    {
+      const auto byte{static_cast<unsigned char>(c)};
+      if (c == '"' || c == '\\')
+        out.append('\\').append(c);
+      else if (byte < 0x20)
+        out.append("\\u00").append(hex[byte >> 4]).append(hex[byte & 0xf]);
+      else
+        out.append(c);
+    }
+    out.append('"');
+  }
+
+  void appendJsonUsage(OutputBuffer &out, const StageUsage &usage)
+  {
+    out.append("\"real\":");
+    appendSeconds(out, usage.wall);
+    out.append(",\"user\":");
+    appendSeconds(out, usage.user);
+    out.append(",\"sys\":");
+    appendSeconds(out, usage.system);
+    out.append(",\"maxrss_kb\":");
+    if (usage.maxRssKb == StageUsage::unknownRss)
+      out.append("null");
+    else
+      out.appendNumber(usage.maxRssKb);
+    out.append(",\"voluntary_switches\":").appendNumber(usage.voluntarySwitches);
+    out.append(",\"involuntary_switches\":").appendNumber(usage.involuntarySwitches);
+  }
+}
+
+void StageUsage::assign(const rusage &usage)
+{
+  user = toMicroseconds(usage.ru_utime);
+  system = toMicroseconds(usage.ru_stime);
+  maxRssKb = usage.ru_maxrss;
+  voluntarySwitches = usage.ru_nvcsw;
+  involuntarySwitches = usage.ru_nivcsw;
+}
+
+void StageUsage::assign(const rusage &before, const rusage &after)
+{
+  user = toMicroseconds(after.ru_utime) - toMicroseconds(before.ru_utime);
+  system = toMicroseconds(after.ru_stime) - toMicroseconds(before.ru_stime);
+  maxRssKb = after.ru_maxrss;
+  voluntarySwitches = after.ru_nvcsw - before.ru_nvcsw;
+  involuntarySwitches = after.ru_nivcsw - before.ru_nivcsw;
+}
+
+void StageUsage::assignSpawned(const rusage &usage, long shellPeakKb)
+{
+  assign(usage);
+  if (maxRssKb <= shellPeakKb)
+    maxRssKb = unknownRss;
+}
+
+long StageUsage::shellPeakKb()
+{
+  rusage self{};
+  if (getrusage(RUSAGE_SELF, &self) != 0)
+    return 0;
+  return self.ru_maxrss;
+}
+
+void TimeReport::write(const std::vector<StageUsage> &stages,
+                       std::chrono::nanoseconds wall,
+                       Format format,
+                       OutputBuffer &out)
+{
+  StageUsage total{};
+  total.wall = wall;
+  total.maxRssKb = StageUsage::unknownRss;
+  for (const auto &stage : stages)
+  {
+    total.user += stage.user;
+    total.system += stage.system;
+    total.maxRssKb = std::max(total.maxRssKb, stage.maxRssKb);
+    total.voluntarySwitches += stage.voluntarySwitches;
+    total.involuntarySwitches += stage.involuntarySwitches;
+  }
+
+  if (format == Format::Json)
+    writeJson(stages, total, out);
+  else
+    writeText(stages, total, out);
+  out.flush();
+}
+
+void TimeReport::writeText(const std::vector<StageUsage> &stages, const StageUsage &total, OutputBuffer &out)
+{
+  out.append("\nreal\t");
+  appendSeconds(out, total.wall);
+  out.append("s\nuser\t");
+  appendSeconds(out, total.user);
+  out.append("s\nsys\t");
+  appendSeconds(out, total.system);
+  out.append("s\n");
+  if (stages.empty())
+    return;
+
+  // maxrss in the total row is the largest stage, since stages run side by
+  // side rather than one after another. A spawned command that stayed below
+  // the shell's own peak shows "-": its real peak is not known.
+  out.append("\nstage      real      user       sys    maxrss    vcsw   ivcsw  status  command\n");
+  auto appendRow{[&out](const StageUsage &usage)
+                 {
+                   appendSeconds(out, usage.wall, 10);
+                   appendSeconds(out, usage.user, 10);
+                   appendSeconds(out, usage.system, 10);
+                   if (usage.maxRssKb == StageUsage::unknownRss)
+                     out.append("       -  ");
+                   else
+                     out.appendNumber(usage.maxRssKb, 8).append("kB");
+                   out.appendNumber(usage.voluntarySwitches, 8);
+                   out.appendNumber(usage.involuntarySwitches, 8);
+                 }};
+
+  for (std::size_t i{}; i < stages.size(); ++i)
+  {
+    out.appendNumber(static_cast<long long>(i + 1), 5);
+    appendRow(stages[i]);
+    out.appendNumber(stages[i].exitCode, 8).append("  ").append(stages[i].name).append('\n');
+  }
+  out.append("total");
+  appendRow(total);
+  out.append('\n');
+}
+
+void TimeReport::writeJson(const std::vector<StageUsage> &stages, const StageUsage &total, OutputBuffer &out)
+{
+  out.append('{');
+  appendJsonUsage(out, total);
+  out.append(",\"stages\":[");
+  for (std::size_t i{}; i < stages.size(); ++i)
+  {
+    if (i > 0)
+      out.append(',');
+    out.append("{\"command\":");
+    appendJsonString(out, stages[i].name);
+    out.append(",\"status\":").appendNumber(stages[i].exitCode).append(',');
+    appendJsonUsage(out, stages[i]);
+    out.append('}');
+  }
+  out.append("]}\n");
+}
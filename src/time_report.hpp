@@ -0,0 +1,56 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+#include "output_buffer.hpp"
+
+// Resources consumed by one stage of a command run under `time`.
+struct StageUsage
+{
+  std::string name{};
+  int exitCode{0};
+  std::chrono::nanoseconds wall{};
+  std::chrono::microseconds user{};
+  std::chrono::microseconds system{};
+  // unknownRss when the stage's own peak cannot be told apart from the
+  // shell's.
+  long maxRssKb{0};
+  long voluntarySwitches{0};
+  long involuntarySwitches{0};
+
+  static constexpr long unknownRss{-1};
+
+  void assign(const rusage &usage);
+  // Usage accrued between two getrusage() samples of the same process.
+  void assign(const rusage &before, const rusage &after);
+  // Usage of a command started with posix_spawn. Its vfork-style child
+  // hands the shell's peak RSS on through exec, so the reported maxrss is
+  // the command's own only when it exceeds `shellPeakKb`, the shell's peak
+  // when the command was spawned; otherwise it is unknown.
+  void assignSpawned(const rusage &usage, long shellPeakKb);
+  static long shellPeakKb();
+};
+
+// Output of the `time` keyword: totals followed by one row per stage, as
+// aligned text for people or as one JSON object per line for scripts.
+class TimeReport
+{
+public:
+  enum class Format
+  {
+    Text,
+    Json
+  };
+
+  static void write(const std::vector<StageUsage> &stages,
+                    std::chrono::nanoseconds wall,
+                    Format format,
+                    OutputBuffer &out);
+
+private:
+  static void writeText(const std::vector<StageUsage> &stages, const StageUsage &total, OutputBuffer &out);
+  static void writeJson(const std::vector<StageUsage> &stages, const StageUsage &total, OutputBuffer &out);
+};
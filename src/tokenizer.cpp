@@ -1,14 +1,194 @@
 #include "tokenizer.hpp"
 
 #include <cctype>
+#include <cstdint>
+#include <utility>
 
-std::vector<std::string> Tokenizer::tokenize(const std::string &line) const
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "tracer.hpp"
+
+namespace
+{
+  enum class RunKind
+  {
+    Unquoted,
+    Double,
+    Single
+  };
+
+  bool isSpecial(char c, RunKind kind)
+  {
+    switch (kind)
+    {
+    case RunKind::Single:
+      return c == '\'';
+    case RunKind::Double:
+      return c == '"' || c == '\\' || c == '$' || c == '`';
+    case RunKind::Unquoted:
+      break;
+    }
+    return c == '|' || c == '&' || c == '\'' || c == '"' || c == '\\' || c == '$' || c == '`' ||
+           std::isspace(static_cast<unsigned char>(c));
+  }
+
+  // Bit i of the mask is set when byte i of the block may be special. For
+  // unquoted text, ASCII whitespace is matched exactly and every non-ASCII
+  // byte is reported too, so isSpecial() can apply the locale's isspace().
+#if defined(__AVX2__)
+  constexpr std::size_t blockSize{32};
+
+  std::uint32_t candidateMask(const char *data, RunKind kind)
+  {
+    const __m256i bytes{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data))};
+    auto equals{[&](char c)
+                { return _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(c)); }};
+
+    __m256i hits{};
+    if (kind == RunKind::Single)
+      hits = equals('\'');
+    else if (kind == RunKind::Double)
+      hits = _mm256_or_si256(_mm256_or_si256(equals('"'), equals('\\')), _mm256_or_si256(equals('$'), equals('`')));
+    else
+    {
+      const __m256i shifted{_mm256_sub_epi8(bytes, _mm256_set1_epi8('\t'))};
+      const __m256i controlSpace{_mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8(4)), shifted)};
+      hits = _mm256_or_si256(_mm256_or_si256(_mm256_or_si256(equals(' '), equals('|')), equals('&')),
+                             _mm256_or_si256(_mm256_or_si256(equals('\''), equals('"')),
+                                             _mm256_or_si256(equals('\\'), controlSpace)));
+      hits = _mm256_or_si256(hits, _mm256_or_si256(equals('$'), equals('`')));
+      hits = _mm256_or_si256(hits, _mm256_cmpgt_epi8(_mm256_setzero_si256(), bytes));
+    }
+    return static_cast<std::uint32_t>(_mm256_movemask_epi8(hits));
+  }
+#elif defined(__SSE2__)
+  constexpr std::size_t blockSize{16};
+
+  std::uint32_t candidateMask(const char *data, RunKind kind)
+  {
+    const __m128i bytes{_mm_loadu_si128(reinterpret_cast<const __m128i *>(data))};
+    auto equals{[&](char c)
+                { return _mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)); }};
+
+    __m128i hits{};
+    if (kind == RunKind::Single)
+      hits = equals('\'');
+    else if (kind == RunKind::Double)
+      hits = _mm_or_si128(_mm_or_si128(equals('"'), equals('\\')), _mm_or_si128(equals('$'), equals('`')));
+    else
+    {
+      const __m128i shifted{_mm_sub_epi8(bytes, _mm_set1_epi8('\t'))};
+      const __m128i controlSpace{_mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted)};
+      hits = _mm_or_si128(_mm_or_si128(_mm_or_si128(equals(' '), equals('|')), equals('&')),
+                          _mm_or_si128(_mm_or_si128(equals('\''), equals('"')),
+                                       _mm_or_si128(equals('\\'), controlSpace)));
+      hits = _mm_or_si128(hits, _mm_or_si128(equals('$'), equals('`')));
+      hits = _mm_or_si128(hits, _mm_cmplt_epi8(bytes, _mm_setzero_si128()));
+    }
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(hits));
+  }
+#endif
+}
+
+std::vector<Word> Tokenizer::tokenize(const std::string &line) const
 {
+  Tracer::Span span{"Tokenizer::tokenize"};
   TokenState state{};
-  Cursor cursor{line};
+  consume(state, line, true);
+  pushToken(state);
+  return state.parts;
+}
+
+void Tokenizer::feed(std::string_view input)
+{
+  Tracer::Span span{"Tokenizer::feed"};
+  std::string_view text{input};
+  if (!carry.empty())
+  {
+    carry.append(input);
+    text = carry;
+  }
+
+  const std::size_t used{consume(pending, text, false)};
+  if (carry.empty())
+    carry.assign(text.substr(used));
+  else
+    carry.erase(0, used);
+}
+
+bool Tokenizer::needsMoreInput() const
+{
+  return pending.mode != Mode::None || pending.openSubstitution || (pending.endsWithPipe && !pending.tokenStarted);
+}
+
+std::vector<Word> Tokenizer::takeTokens()
+{
+  consume(pending, carry, true);
+  pushToken(pending);
+  std::vector<Word> parts{std::move(pending.parts)};
+  reset();
+  return parts;
+}
+
+void Tokenizer::reset()
+{
+  pending = TokenState{};
+  carry.clear();
+}
+
+std::size_t Tokenizer::consume(TokenState &state, std::string_view text, bool endOfInput) const
+{
+  Cursor cursor{text};
+  // An open substitution left by the last feed() starts the carried text.
+  SubstitutionScan scan{state.openSubstitution ? state.substitution : SubstitutionScan{}};
+  state.openSubstitution = false;
 
   while (!cursor.atEnd())
   {
+    // Copy runs of ordinary bytes in bulk; the state machine below only
+    // ever sees bytes that can change the state.
+    if (const std::size_t run{plainRunLength(text, cursor.index, state.mode)}; run > 0)
+    {
+      state.currentWord.text.append(text, cursor.index, run);
+      state.tokenStarted = true;
+      cursor.index += run;
+      continue;
+    }
+
+    // A complete substitution is recorded in the word for the shell to run
+    // later. One that is still open at the end of a fed chunk keeps its
+    // scan state, and the next feed() resumes it; at the end of the input
+    // it is literal text.
+    if (const char c{cursor.current()};
+        state.mode != Mode::Single && (c == '`' || (c == '$' && cursor.hasNext() && cursor.next() == '(')))
+    {
+      const auto end{substitutionEnd(text, cursor.index, scan)};
+      if (end)
+      {
+        state.currentWord.substitutions.push_back({state.currentWord.text.size(),
+                                                   substitutionBody(text, cursor.index, *end),
+                                                   state.mode == Mode::Double});
+        state.tokenStarted = true;
+        cursor.index = *end;
+        scan = SubstitutionScan{};
+        continue;
+      }
+      if (!endOfInput)
+      {
+        state.openSubstitution = true;
+        state.substitution = scan;
+        break;
+      }
+      scan = SubstitutionScan{};
+    }
+
+    // A backslash at the end of a fed chunk escapes whatever comes next, so
+    // leave it for the next feed().
+    if (!endOfInput && state.mode != Mode::Single && cursor.current() == '\\' && !cursor.hasNext())
+      break;
+
     switch (state.mode)
     {
     case Mode::Single:
@@ -23,15 +203,121 @@ std::vector<std::string> Tokenizer::tokenize(const std::string &line) const
     }
   }
 
-  pushToken(state);
-  return state.parts;
+  return cursor.index;
+}
+
+std::size_t Tokenizer::plainRunLength(std::string_view line, std::size_t from, Mode mode)
+{
+  const RunKind kind{mode == Mode::Single   ? RunKind::Single
+                     : mode == Mode::Double ? RunKind::Double
+                                            : RunKind::Unquoted};
+  const char *data{line.data()};
+  std::size_t index{from};
+
+#if defined(__AVX2__) || defined(__SSE2__)
+  while (index + blockSize <= line.size())
+  {
+    for (std::uint32_t mask{candidateMask(data + index, kind)}; mask != 0; mask &= mask - 1)
+    {
+      const std::size_t position{index + static_cast<std::size_t>(__builtin_ctz(mask))};
+      if (isSpecial(data[position], kind))
+        return position - from;
+    }
+    index += blockSize;
+  }
+#endif
+
+  while (index < line.size() && !isSpecial(data[index], kind))
+    ++index;
+  return index - from;
+}
+
+std::optional<std::size_t> Tokenizer::substitutionEnd(std::string_view text, std::size_t start, SubstitutionScan &scan)
+{
+  using Quote = SubstitutionScan::Quote;
+  const bool backtick{text[start] == '`'};
+  if (scan.offset == 0)
+    scan.offset = backtick ? 1 : 2;
+
+  // Parentheses only count outside quotes, so `$(echo ")")` closes at the
+  // last one; nested $(...) just deepens the count. Inside backticks only
+  // an unescaped backtick ends the substitution.
+  std::size_t i{start + scan.offset};
+  for (; i < text.size(); ++i)
+  {
+    const char c{text[i]};
+    if (backtick)
+    {
+      if (c == '\\')
+        ++i;
+      else if (c == '`')
+        return i + 1;
+      continue;
+    }
+
+    switch (scan.quote)
+    {
+    case Quote::Single:
+      if (c == '\'')
+        scan.quote = Quote::None;
+      break;
+    case Quote::Double:
+      if (c == '\\')
+        ++i;
+      else if (c == '"')
+        scan.quote = Quote::None;
+      break;
+    case Quote::Backtick:
+      if (c == '\\')
+        ++i;
+      else if (c == '`')
+        scan.quote = Quote::None;
+      break;
+    case Quote::None:
+      if (c == '\\')
+        ++i;
+      else if (c == '\'')
+        scan.quote = Quote::Single;
+      else if (c == '"')
+        scan.quote = Quote::Double;
+      else if (c == '`')
+        scan.quote = Quote::Backtick;
+      else if (c == '(')
+        ++scan.depth;
+      else if (c == ')' && --scan.depth == 0)
+        return i + 1;
+      break;
+    }
+  }
+
+  scan.offset = i - start;
+  return std::nullopt;
+}
+
+std::string Tokenizer::substitutionBody(std::string_view text, std::size_t start, std::size_t end)
+{
+  if (text[start] == '$')
+    return std::string{text.substr(start + 2, end - start - 3)};
+
+  // Inside backticks a backslash only escapes `, $ and itself.
+  std::string body{};
+  for (std::size_t i{start + 1}; i + 1 < end; ++i)
+  {
+    if (text[i] == '\\' && i + 2 < end && (text[i + 1] == '`' || text[i + 1] == '$' || text[i + 1] == '\\'))
+      ++i;
+    body.push_back(text[i]);
+  }
+  return body;
 }
 
 void Tokenizer::pushToken(TokenState &state) const
 {
   if (state.tokenStarted)
-    state.parts.push_back(state.currentToken);
-  state.currentToken.clear();
+  {
+    state.parts.push_back(std::move(state.currentWord));
+    state.endsWithPipe = false;
+  }
+  state.currentWord = Word{};
   state.tokenStarted = false;
 }
 
@@ -46,7 +332,7 @@ void Tokenizer::handleSingle(TokenState &state, Cursor &cursor) const
     return;
   }
 
-  state.currentToken.push_back(c);
+  state.currentWord.text.push_back(c);
   state.tokenStarted = true;
   cursor.advance();
 }
@@ -67,20 +353,20 @@ void Tokenizer::handleDouble(TokenState &state, Cursor &cursor) const
     char next{cursor.next()};
     if (next == '"' || next == '\\' || next == '$' || next == '`')
     {
-      state.currentToken.push_back(next);
+      state.currentWord.text.push_back(next);
       cursor.advance();
       cursor.advance();
     }
     else
     {
-      state.currentToken.push_back(c);
+      state.currentWord.text.push_back(c);
       cursor.advance();
     }
     state.tokenStarted = true;
     return;
   }
 
-  state.currentToken.push_back(c);
+  state.currentWord.text.push_back(c);
   state.tokenStarted = true;
   cursor.advance();
 }
@@ -91,8 +377,29 @@ void Tokenizer::handleNone(TokenState &state, Cursor &cursor) const
   if (c == '|')
   {
     pushToken(state);
-    state.parts.push_back("|");
+    state.parts.push_back(Word{"|"});
+    state.endsWithPipe = true;
+    cursor.advance();
+    return;
+  }
+  if (c == '&')
+  {
+    // `>&` stays inside its redirection word (`2>&1`); `&&` becomes one
+    // operator word so the shell can reject it instead of running the left
+    // side in the background.
+    if (state.tokenStarted && !state.currentWord.literal && state.currentWord.text.ends_with('>'))
+    {
+      state.currentWord.text.push_back(c);
+      cursor.advance();
+      return;
+    }
+    pushToken(state);
+    const bool doubled{cursor.hasNext() && cursor.next() == '&'};
+    state.parts.push_back(Word{doubled ? "&&" : "&"});
+    state.endsWithPipe = false;
     cursor.advance();
+    if (doubled)
+      cursor.advance();
     return;
   }
   if (std::isspace(static_cast<unsigned char>(c)))
@@ -104,6 +411,7 @@ void Tokenizer::handleNone(TokenState &state, Cursor &cursor) const
   if (c == '\'')
   {
     state.mode = Mode::Single;
+    state.currentWord.literal = true;
     state.tokenStarted = true;
     cursor.advance();
     return;
@@ -111,20 +419,22 @@ void Tokenizer::handleNone(TokenState &state, Cursor &cursor) const
   if (c == '"')
   {
     state.mode = Mode::Double;
+    state.currentWord.literal = true;
     state.tokenStarted = true;
     cursor.advance();
     return;
   }
   if (c == '\\' && cursor.hasNext())
   {
-    state.currentToken.push_back(cursor.next());
+    state.currentWord.text.push_back(cursor.next());
     cursor.advance();
     cursor.advance();
+    state.currentWord.literal = true;
     state.tokenStarted = true;
     return;
   }
 
-  state.currentToken.push_back(c);
+  state.currentWord.text.push_back(c);
   state.tokenStarted = true;
   cursor.advance();
 }
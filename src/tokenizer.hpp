@@ -1,12 +1,47 @@
 #pragma once
 
+#include <cstddef>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+// One word of a command line, with its quotes removed. Operators (`|`,
+// `&`, `>`, ...) and keywords are only recognised in bare words; anything
+// quoted or escaped is `literal`. $(...) and backtick substitutions are kept
+// unexpanded, as the command and the offset in `text` where its output
+// goes, until Shell::expandWords runs them just before the command.
+struct Word
+{
+  struct Substitution
+  {
+    std::size_t offset{0};
+    std::string command{};
+    bool quoted{false};
+  };
+
+  std::string text{};
+  bool literal{false};
+  std::vector<Substitution> substitutions{};
+
+  bool isBare(std::string_view bare) const
+  {
+    return !literal && substitutions.empty() && text == bare;
+  }
+};
+
 class Tokenizer
 {
 public:
-  std::vector<std::string> tokenize(const std::string &line) const;
+  std::vector<Word> tokenize(const std::string &line) const;
+
+  // Incremental interface for input that arrives a line at a time. Only the
+  // new bytes are scanned on each feed(); the quote mode and the partially
+  // built token carry over between calls.
+  void feed(std::string_view input);
+  bool needsMoreInput() const;
+  std::vector<Word> takeTokens();
+  void reset();
 
 private:
   enum class Mode
@@ -16,17 +51,40 @@ private:
     Double
   };
 
+  // Progress through a $(...) or backtick substitution that a fed chunk
+  // ended inside of, so the next feed() carries on from where this one
+  // stopped. `offset` is relative to the substitution's first byte; 0
+  // means the scan has not started.
+  struct SubstitutionScan
+  {
+    enum class Quote
+    {
+      None,
+      Single,
+      Double,
+      Backtick
+    };
+
+    std::size_t offset{0};
+    std::size_t depth{1};
+    Quote quote{Quote::None};
+  };
+
   struct TokenState
   {
-    std::vector<std::string> parts{};
-    std::string currentToken{};
+    std::vector<Word> parts{};
+    Word currentWord{};
     bool tokenStarted{false};
+    bool endsWithPipe{false};
+    // The text stops inside a $(...) or backtick substitution.
+    bool openSubstitution{false};
+    SubstitutionScan substitution{};
     Mode mode{Mode::None};
   };
 
   struct Cursor
   {
-    const std::string &line;
+    std::string_view line;
     std::size_t index{0};
 
     bool atEnd() const
@@ -55,6 +113,13 @@ private:
     }
   };
 
+  TokenState pending{};
+  std::string carry{};
+
+  static std::size_t plainRunLength(std::string_view line, std::size_t from, Mode mode);
+  static std::optional<std::size_t> substitutionEnd(std::string_view text, std::size_t start, SubstitutionScan &scan);
+  static std::string substitutionBody(std::string_view text, std::size_t start, std::size_t end);
+  std::size_t consume(TokenState &state, std::string_view text, bool endOfInput) const;
   void pushToken(TokenState &state) const;
   void handleSingle(TokenState &state, Cursor &cursor) const;
   void handleDouble(TokenState &state, Cursor &cursor) const;
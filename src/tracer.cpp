@@ -0,0 +1,210 @@
+#include "tracer.hpp"
+
+#include <charconv>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "fd_utils.hpp"
+
+bool Tracer::active{false};
+
+namespace
+{
+  constexpr std::size_t flushThreshold{64 * 1024};
+
+  // Events are buffered and appended to the file in large writes. The file
+  // is a JSON array left open on purpose: the trace viewers accept a missing
+  // "]", so a trace cut short by a crash or exec is still readable. A
+  // forked child keeps its own buffer and appends to the same file under
+  // its own pid.
+  struct TraceFile
+  {
+    UniqueFd fd{};
+    pid_t owner{-1};
+    std::chrono::steady_clock::time_point epoch{};
+    std::mutex mutex{};
+    std::string buffer{};
+
+    ~TraceFile()
+    {
+      if (fd && owner == getpid())
+        writeBuffer();
+    }
+
+    void writeBuffer()
+    {
+      std::string_view pending{buffer};
+      while (!pending.empty())
+      {
+        const ssize_t written{::write(fd.get(), pending.data(), pending.size())};
+        if (written <= 0)
+          break;
+        pending.remove_prefix(static_cast<std::size_t>(written));
+      }
+      buffer.clear();
+    }
+  };
+
+  TraceFile traceFile{};
+
+  void appendMicroseconds(std::string &out, std::chrono::nanoseconds value)
+  {
+    char digits[32]{};
+    const double micros{std::chrono::duration<double, std::micro>{value}.count()};
+    const auto result{std::to_chars(digits, digits + sizeof(digits), micros, std::chars_format::fixed, 3)};
+    out.append(digits, result.ptr);
+  }
+
+  void appendInteger(std::string &out, long long value)
+  {
+    char digits[24]{};
+    const auto result{std::to_chars(digits, digits + sizeof(digits), value)};
+    out.append(digits, result.ptr);
+  }
+
+  void appendJsonString(std::string &out, std::string_view text)
+  {
+    static constexpr char hex[]{"0123456789abcdef"};
+    out.push_back('"');
+    for (char c : text)
+    {
+      const auto byte{static_cast<unsigned char>(c)};
+      if (c == '"' || c == '\\')
+      {
+        out.push_back('\\');
+        out.push_back(c);
+      }
+      else if (byte < 0x20)
+      {
+        out.append("\\u00");
+        out.push_back(hex[byte >> 4]);
+        out.push_back(hex[byte & 0xf]);
+      }
+      else
+        out.push_back(c);
+    }
+    out.push_back('"');
+  }
+
+  // fork() copies the lock in whatever state it is in. Another thread (a
+  // builtin stage, the directory listing worker) may be holding it, and the
+  // child would then hang on its first event, so take the lock across the
+  // fork and release it on both sides.
+  void lockForFork()
+  {
+    traceFile.mutex.lock();
+  }
+
+  void unlockAfterFork()
+  {
+    traceFile.mutex.unlock();
+  }
+
+  // The parent still owns and writes out the events buffered before the
+  // fork; the child starts empty and records from here on.
+  void adoptAfterFork()
+  {
+    traceFile.buffer.clear();
+    traceFile.owner = getpid();
+    traceFile.mutex.unlock();
+  }
+
+  void appendHeader(std::string &out, const char *name, char phase, std::chrono::steady_clock::time_point at)
+  {
+    out.append("{\"name\":");
+    appendJsonString(out, name);
+    out.append(",\"cat\":\"shell\",\"ph\":\"").push_back(phase);
+    out.append("\",\"pid\":");
+    appendInteger(out, getpid());
+    out.append(",\"tid\":");
+    appendInteger(out, gettid());
+    out.append(",\"ts\":");
+    appendMicroseconds(out, at - traceFile.epoch);
+  }
+}
+
+void Tracer::startFromEnvironment()
+{
+  const char *path{std::getenv("SHELL_TRACE")};
+  if (!path || *path == '\0')
+    return;
+
+  UniqueFd fd{::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)};
+  if (!fd)
+  {
+    std::cerr << "trace: " << path << ": cannot open\n";
+    return;
+  }
+
+  traceFile.fd = std::move(fd);
+  traceFile.owner = getpid();
+  traceFile.epoch = std::chrono::steady_clock::now();
+  // Written now so that no child's events can land before it.
+  traceFile.buffer = "[\n";
+  traceFile.writeBuffer();
+  pthread_atfork(lockForFork, unlockAfterFork, adoptAfterFork);
+  active = true;
+}
+
+void Tracer::counter(const char *name, long long value)
+{
+  if (!active)
+    return;
+
+  std::string event{};
+  appendHeader(event, name, 'C', std::chrono::steady_clock::now());
+  event.append(",\"args\":{\"value\":");
+  appendInteger(event, value);
+  event.append("}},\n");
+  record(event);
+}
+
+Tracer::Span::Span(const char *name, std::string_view detail)
+{
+  if (!active)
+    return;
+  this->name = name;
+  this->detail = detail;
+  pid = getpid();
+  started = std::chrono::steady_clock::now();
+}
+
+Tracer::Span::~Span()
+{
+  if (!name || pid != getpid())
+    return;
+
+  const auto finished{std::chrono::steady_clock::now()};
+  std::string event{};
+  appendHeader(event, name, 'X', started);
+  event.append(",\"dur\":");
+  appendMicroseconds(event, finished - started);
+  if (!detail.empty())
+  {
+    event.append(",\"args\":{\"detail\":");
+    appendJsonString(event, detail);
+    event.push_back('}');
+  }
+  event.append("},\n");
+  record(event);
+}
+
+void Tracer::record(std::string_view event)
+{
+  const std::lock_guard lock{traceFile.mutex};
+  traceFile.buffer.append(event);
+  if (traceFile.buffer.size() >= flushThreshold)
+    traceFile.writeBuffer();
+}
+
+void Tracer::flush()
+{
+  if (!active)
+    return;
+  const std::lock_guard lock{traceFile.mutex};
+  traceFile.writeBuffer();
+}
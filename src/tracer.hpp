@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+// Opt-in recorder of Chrome trace events (chrome://tracing, Perfetto). Set
+// SHELL_TRACE to a file path and every Span in the shell is written there
+// as a complete ("X") event. When tracing is off a Span costs one branch.
+class Tracer
+{
+public:
+  // Starts recording if SHELL_TRACE names a file that can be created.
+  static void startFromEnvironment();
+  static bool enabled()
+  {
+    return active;
+  }
+
+  // Records a counter ("C") event, e.g. the size of a data structure.
+  static void counter(const char *name, long long value);
+  // Writes out buffered events; needed before the shell replaces itself
+  // with execve, and before a forked child leaves through _exit.
+  static void flush();
+
+  class Span
+  {
+  public:
+    explicit Span(const char *name, std::string_view detail = {});
+    ~Span();
+
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+
+  private:
+    const char *name{nullptr};
+    std::string detail{};
+    std::chrono::steady_clock::time_point started{};
+    // A span open across fork() is only the parent's to record.
+    pid_t pid{-1};
+  };
+
+private:
+  static bool active;
+
+  static void record(std::string_view event);
+};
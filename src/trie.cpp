@@ -1,10 +1,27 @@
 #include "trie.hpp"
 
 #include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+
+Trie::Trie()
+{
+  clear();
+}
 
 void Trie::clear()
 {
-  root = Node{};
+  nodes.clear();
+  childSlots.clear();
+  labels.clear();
+  freeNodes.clear();
+  wastedSlots = 0;
+  wastedLabelBytes = 0;
+  mapped.reset();
+  nodes.emplace_back();
 }
 
 void Trie::insert(std::string_view word)
@@ -18,129 +35,526 @@ void Trie::insert(std::string_view word, NodeKind nodeKind)
     return;
   if (nodeKind == NodeKind::NotExecutable)
     return;
+  detachImage();
 
-  bool isNewWord{true};
-  if (const Node *existing{findNode(word)}; existing && existing->nodeKind != NodeKind::NotExecutable)
-    isNewWord = false;
+  if (const auto locus{locate(word)};
+      locus && locus->consumed == nodes[locus->node].labelLength &&
+      nodes[locus->node].nodeKind != NodeKind::NotExecutable)
+  {
+    Node &existing{nodes[locus->node]};
+    if (existing.nodeKind == NodeKind::Builtin && nodeKind == NodeKind::PathExecutable)
+      return;
+    existing.nodeKind = nodeKind;
+    return;
+  }
 
-  Node *node{&root};
-  if (isNewWord)
-    node->subtreeCount++;
-  for (char c : word)
+  Index node{rootIndex};
+  nodes[node].subtreeCount++;
+  std::size_t pos{0};
+  while (pos < word.size())
   {
-    auto &child{node->children[c]};
-    if (!child)
-      child = std::make_unique<Node>();
-    node = child.get();
-    if (isNewWord)
-      node->subtreeCount++;
+    bool found{false};
+    const Index slot{findChildSlot(node, static_cast<unsigned char>(word[pos]), found)};
+    if (!found)
+    {
+      const Index leaf{allocateNode(static_cast<Index>(labels.size()), static_cast<Index>(word.size() - pos))};
+      labels.append(word.substr(pos));
+      nodes[leaf].subtreeCount = 1;
+      nodes[leaf].nodeKind = nodeKind;
+      insertChild(node, slot, leaf);
+      return;
+    }
+
+    const Index child{childAt(node, slot)};
+    const std::string_view label{labelOf(child)};
+    const std::string_view rest{word.substr(pos)};
+    const auto mismatch{std::mismatch(label.begin(), label.end(), rest.begin(), rest.end())};
+    const Index common{static_cast<Index>(mismatch.first - label.begin())};
+
+    if (common == label.size())
+    {
+      nodes[child].subtreeCount++;
+      node = child;
+      pos += common;
+      continue;
+    }
+
+    // Split the edge: the new node takes the shared head of the label and
+    // the existing child keeps the tail. Labels are views into the arena, so
+    // no bytes are copied.
+    const Index middle{allocateNode(nodes[child].labelOffset, common)};
+    nodes[middle].subtreeCount = nodes[child].subtreeCount + 1;
+    nodes[child].labelOffset += common;
+    nodes[child].labelLength -= common;
+    reserveChildren(middle, 2);
+    childSlots[nodes[middle].childOffset] = child;
+    nodes[middle].childCount = 1;
+    childSlots[nodes[node].childOffset + slot] = middle;
+
+    node = middle;
+    pos += common;
   }
-  if (node->nodeKind == NodeKind::Builtin && nodeKind == NodeKind::PathExecutable)
-    return;
-  node->nodeKind = nodeKind;
+
+  nodes[node].nodeKind = nodeKind;
+}
+
+bool Trie::remove(std::string_view word)
+{
+  if (!contains(word))
+    return false;
+  detachImage();
+
+  // (parent, slot in parent) for every node on the path below the root.
+  std::vector<std::pair<Index, Index>> path{};
+  Index node{rootIndex};
+  nodes[node].subtreeCount--;
+  std::size_t pos{0};
+  while (pos < word.size())
+  {
+    bool found{false};
+    const Index slot{findChildSlot(node, static_cast<unsigned char>(word[pos]), found)};
+    const Index child{childAt(node, slot)};
+    path.emplace_back(node, slot);
+    nodes[child].subtreeCount--;
+    pos += nodes[child].labelLength;
+    node = child;
+  }
+
+  nodes[node].nodeKind = NodeKind::NotExecutable;
+  if (nodes[node].subtreeCount == 0)
+  {
+    const auto [parent, slot]{path.back()};
+    eraseChild(parent, slot);
+    releaseNode(node);
+    if (parent != rootIndex && nodes[parent].nodeKind == NodeKind::NotExecutable && nodes[parent].childCount == 1)
+      mergeWithOnlyChild(parent);
+  }
+  else if (nodes[node].childCount == 1)
+  {
+    mergeWithOnlyChild(node);
+  }
+
+  compactIfWasteful();
+  return true;
 }
 
 bool Trie::contains(std::string_view word) const
 {
-  const Node *node{findNode(word)};
-  return node && node->nodeKind != NodeKind::NotExecutable;
+  const auto locus{locate(word)};
+  if (!locus)
+    return false;
+  const Node &node{nodeAt(locus->node)};
+  return locus->consumed == node.labelLength && node.nodeKind != NodeKind::NotExecutable;
 }
 
 bool Trie::hasPrefix(std::string_view prefix) const
 {
-  return findNode(prefix) != nullptr;
+  return locate(prefix).has_value();
 }
 
 std::size_t Trie::countWithPrefix(std::string_view prefix) const
 {
-  const Node *node{findNode(prefix)};
-  return node ? node->subtreeCount : 0;
+  const auto locus{locate(prefix)};
+  return locus ? nodeAt(locus->node).subtreeCount : 0;
 }
 
 std::optional<std::string> Trie::uniqueCompletion(std::string_view prefix) const
 {
-  const Node *node{findNode(prefix)};
-  if (!node || node->subtreeCount != 1)
+  const auto locus{locate(prefix)};
+  if (!locus || nodeAt(locus->node).subtreeCount != 1)
     return std::nullopt;
-
-  std::string result{prefix};
-  while (node && node->nodeKind == NodeKind::NotExecutable)
-  {
-    if (node->children.empty())
-      break;
-    const auto it{node->children.begin()};
-    result.push_back(it->first);
-    node = it->second.get();
-  }
-  return result;
+  return extendFrom(*locus, prefix);
 }
 
 std::string Trie::longestCommonPrefix(std::string_view prefix) const
 {
-  const Node *node{findNode(prefix)};
-  if (!node)
+  const auto locus{locate(prefix)};
+  if (!locus)
     return "";
+  return extendFrom(*locus, prefix);
+}
 
-  std::string result{prefix};
-  while (node->children.size() == 1 && node->nodeKind == NodeKind::NotExecutable)
-  {
-    const auto it{node->children.begin()};
-    result.push_back(it->first);
-    node = it->second.get();
-  }
-  return result;
+void Trie::visitWithPrefix(std::string_view prefix, const Visitor &visitor) const
+{
+  const auto locus{locate(prefix)};
+  if (!locus)
+    return;
+
+  std::string current{prefix};
+  current.append(labelOf(locus->node).substr(locus->consumed));
+  visitFrom(locus->node, current, visitor);
 }
 
-std::vector<std::string> Trie::collectWithPrefix(std::string_view prefix) const
+std::vector<std::string> Trie::collectWithPrefix(std::string_view prefix, std::size_t limit) const
 {
   std::vector<std::string> results{};
-  const Node *node{findNode(prefix)};
-  if (!node)
+  if (limit == 0)
     return results;
 
-  std::string current{prefix};
-  collectFrom(node, current, results);
-  std::sort(results.begin(), results.end());
+  results.reserve(std::min(countWithPrefix(prefix), limit));
+  visitWithPrefix(prefix, [&results, limit](std::string_view word)
+                  {
+                    results.emplace_back(word);
+                    return results.size() < limit;
+                  });
   return results;
 }
 
-Trie::Node *Trie::findNode(std::string_view text)
+std::size_t Trie::memoryUsage() const
+{
+  return sizeof(*this) + nodes.capacity() * sizeof(Node) + childSlots.capacity() * sizeof(Index) +
+         labels.capacity() + freeNodes.capacity() * sizeof(Index) + (mapped ? mapped->byteSize : 0);
+}
+
+std::string Trie::serialize() const
+{
+  const Node *nodeData{mapped ? mapped->nodes : nodes.data()};
+  const Index *slotData{mapped ? mapped->childSlots : childSlots.data()};
+  const std::string_view labelData{mapped ? mapped->labels : std::string_view{labels}};
+
+  ImageHeader header{};
+  header.magic = imageMagic;
+  header.nodeCount = static_cast<std::uint32_t>(mapped ? mapped->nodeCount : nodes.size());
+  header.slotCount = static_cast<std::uint32_t>(mapped ? mapped->slotCount : childSlots.size());
+  header.freeCount = static_cast<std::uint32_t>(freeNodes.size());
+  header.labelSize = static_cast<std::uint32_t>(labelData.size());
+  header.wastedSlots = static_cast<std::uint32_t>(wastedSlots);
+  header.wastedLabelBytes = static_cast<std::uint32_t>(wastedLabelBytes);
+  header.layout = imageLayout();
+
+  std::string image{};
+  image.reserve(sizeof(header) + header.nodeCount * sizeof(Node) + header.slotCount * sizeof(Index) +
+                header.freeCount * sizeof(Index) + header.labelSize);
+  image.append(reinterpret_cast<const char *>(&header), sizeof(header));
+  image.append(reinterpret_cast<const char *>(nodeData), header.nodeCount * sizeof(Node));
+  image.append(reinterpret_cast<const char *>(slotData), header.slotCount * sizeof(Index));
+  image.append(reinterpret_cast<const char *>(freeNodes.data()), header.freeCount * sizeof(Index));
+  image.append(labelData);
+  header.checksum = imageChecksum(std::string_view{image}.substr(sizeof(header)));
+  std::memcpy(image.data(), &header, sizeof(header));
+  return image;
+}
+
+bool Trie::attachImage(const void *data, std::size_t size)
+{
+  static_assert(std::is_trivially_copyable_v<Node>);
+
+  ImageHeader header{};
+  if (!data || size < sizeof(header) || reinterpret_cast<std::uintptr_t>(data) % alignof(Node) != 0)
+    return false;
+  std::memcpy(&header, data, sizeof(header));
+
+  const std::size_t nodeBytes{std::size_t{header.nodeCount} * sizeof(Node)};
+  const std::size_t slotBytes{std::size_t{header.slotCount} * sizeof(Index)};
+  const std::size_t freeBytes{std::size_t{header.freeCount} * sizeof(Index)};
+  if (header.magic != imageMagic || header.layout != imageLayout() || header.nodeCount == 0 ||
+      size != sizeof(header) + nodeBytes + slotBytes + freeBytes + header.labelSize ||
+      header.wastedSlots > header.slotCount || header.wastedLabelBytes > header.labelSize)
+    return false;
+  // Lookups trust the arenas blindly. The image is only ever written whole
+  // by serialize(), so a matching checksum stands in for walking the tree.
+  if (header.checksum != imageChecksum({static_cast<const char *>(data) + sizeof(header), size - sizeof(header)}))
+    return false;
+
+  const char *cursor{static_cast<const char *>(data) + sizeof(header)};
+  MappedImage image{};
+  image.nodes = reinterpret_cast<const Node *>(cursor);
+  image.nodeCount = header.nodeCount;
+  cursor += nodeBytes;
+  image.childSlots = reinterpret_cast<const Index *>(cursor);
+  image.slotCount = header.slotCount;
+  cursor += slotBytes;
+  const auto *freeData{reinterpret_cast<const Index *>(cursor)};
+  cursor += freeBytes;
+  image.labels = std::string_view{cursor, header.labelSize};
+  image.byteSize = size;
+
+  clear();
+  freeNodes.assign(freeData, freeData + header.freeCount);
+
+  wastedSlots = header.wastedSlots;
+  wastedLabelBytes = header.wastedLabelBytes;
+  mapped = image;
+  return true;
+}
+
+std::uint32_t Trie::imageLayout()
+{
+  // FNV-1a over everything that decides how the arenas are laid out, so an
+  // image written by a different build (or format) is rebuilt, not misread.
+  std::uint32_t hash{2166136261u};
+  auto mix{[&hash](std::uint64_t value)
+           {
+             for (int shift{0}; shift < 64; shift += 8)
+             {
+               hash ^= static_cast<std::uint8_t>(value >> shift);
+               hash *= 16777619u;
+             }
+           }};
+  mix(imageVersion);
+  mix(std::endian::native == std::endian::little);
+  mix(sizeof(Index));
+  mix(sizeof(ImageHeader));
+  mix(sizeof(Node));
+  mix(alignof(Node));
+  mix(offsetof(Node, labelOffset));
+  mix(offsetof(Node, labelLength));
+  mix(offsetof(Node, childOffset));
+  mix(offsetof(Node, childCount));
+  mix(offsetof(Node, childCapacity));
+  mix(offsetof(Node, subtreeCount));
+  mix(offsetof(Node, nodeKind));
+  mix(sizeof(NodeKind));
+  for (const char c : std::string_view{__VERSION__})
+    mix(static_cast<unsigned char>(c));
+  return hash;
+}
+
+std::uint64_t Trie::imageChecksum(std::string_view bytes)
+{
+  // Eight bytes per step; this runs over the whole index on every startup.
+  constexpr std::uint64_t prime{0x9e3779b97f4a7c15u};
+  std::uint64_t hash{bytes.size() * prime};
+  std::size_t i{};
+  for (; i + sizeof(std::uint64_t) <= bytes.size(); i += sizeof(std::uint64_t))
+  {
+    std::uint64_t word{};
+    std::memcpy(&word, bytes.data() + i, sizeof(word));
+    hash = std::rotl(hash ^ word, 29) * prime;
+  }
+  for (; i < bytes.size(); ++i)
+    hash = std::rotl(hash ^ static_cast<unsigned char>(bytes[i]), 29) * prime;
+  return hash ^ (hash >> 32);
+}
+
+const Trie::Node &Trie::nodeAt(Index node) const
+{
+  return mapped ? mapped->nodes[node] : nodes[node];
+}
+
+void Trie::detachImage()
 {
-  Node *node{&root};
-  for (char c : text)
+  if (!mapped)
+    return;
+
+  const MappedImage image{*mapped};
+  mapped.reset();
+  nodes.assign(image.nodes, image.nodes + image.nodeCount);
+  childSlots.assign(image.childSlots, image.childSlots + image.slotCount);
+  labels.assign(image.labels);
+}
+
+std::optional<Trie::Locus> Trie::locate(std::string_view text) const
+{
+  Locus locus{};
+  std::size_t pos{0};
+  while (pos < text.size())
   {
-    auto it{node->children.find(c)};
-    if (it == node->children.end())
-      return nullptr;
-    node = it->second.get();
+    bool found{false};
+    const Index slot{findChildSlot(locus.node, static_cast<unsigned char>(text[pos]), found)};
+    if (!found)
+      return std::nullopt;
+
+    const Index child{childAt(locus.node, slot)};
+    const std::string_view label{labelOf(child)};
+    const std::string_view rest{text.substr(pos)};
+    const std::size_t length{std::min(label.size(), rest.size())};
+    if (label.compare(0, length, rest, 0, length) != 0)
+      return std::nullopt;
+
+    locus.node = child;
+    locus.consumed = static_cast<Index>(length);
+    pos += length;
   }
-  return node;
+  return locus;
+}
+
+std::string_view Trie::labelOf(Index node) const
+{
+  const std::string_view arena{mapped ? mapped->labels : std::string_view{labels}};
+  return arena.substr(nodeAt(node).labelOffset, nodeAt(node).labelLength);
+}
+
+unsigned char Trie::firstByte(Index node) const
+{
+  return static_cast<unsigned char>(labelOf(node).front());
+}
+
+Trie::Index Trie::childAt(Index node, Index slot) const
+{
+  const Index *slots{mapped ? mapped->childSlots : childSlots.data()};
+  return slots[nodeAt(node).childOffset + slot];
 }
 
-const Trie::Node *Trie::findNode(std::string_view text) const
+Trie::Index Trie::findChildSlot(Index node, unsigned char c, bool &found) const
 {
-  const Node *node{&root};
-  for (char c : text)
+  const Index *slots{mapped ? mapped->childSlots : childSlots.data()};
+  const Index *begin{slots + nodeAt(node).childOffset};
+  const Index *end{begin + nodeAt(node).childCount};
+  const auto it{std::lower_bound(begin, end, c,
+                                 [this](Index child, unsigned char value)
+                                 { return firstByte(child) < value; })};
+  found = it != end && firstByte(*it) == c;
+  return static_cast<Index>(it - begin);
+}
+
+Trie::Index Trie::allocateNode(Index labelOffset, Index labelLength)
+{
+  Index index{};
+  if (!freeNodes.empty())
+  {
+    index = freeNodes.back();
+    freeNodes.pop_back();
+    nodes[index] = Node{};
+  }
+  else
   {
-    auto it{node->children.find(c)};
-    if (it == node->children.end())
-      return nullptr;
-    node = it->second.get();
+    index = static_cast<Index>(nodes.size());
+    nodes.emplace_back();
   }
-  return node;
+  nodes[index].labelOffset = labelOffset;
+  nodes[index].labelLength = labelLength;
+  return index;
+}
+
+void Trie::releaseNode(Index node)
+{
+  wastedSlots += nodes[node].childCapacity;
+  wastedLabelBytes += nodes[node].labelLength;
+  nodes[node] = Node{};
+  freeNodes.push_back(node);
 }
 
-void Trie::collectFrom(const Node *node, std::string &current, std::vector<std::string> &results) const
+void Trie::reserveChildren(Index node, Index capacity)
 {
-  if (!node)
+  Node &target{nodes[node]};
+  if (target.childCapacity >= capacity)
     return;
-  if (node->nodeKind != NodeKind::NotExecutable)
-    results.push_back(current);
 
-  for (const auto &entry : node->children)
+  const Index newOffset{static_cast<Index>(childSlots.size())};
+  childSlots.resize(childSlots.size() + capacity);
+  std::copy_n(childSlots.begin() + target.childOffset, target.childCount, childSlots.begin() + newOffset);
+  wastedSlots += target.childCapacity;
+  target.childOffset = newOffset;
+  target.childCapacity = capacity;
+}
+
+void Trie::insertChild(Index node, Index slot, Index child)
+{
+  if (nodes[node].childCount == nodes[node].childCapacity)
+    reserveChildren(node, std::max<Index>(2, nodes[node].childCapacity * 2));
+
+  Node &target{nodes[node]};
+  const auto begin{childSlots.begin() + target.childOffset};
+  std::copy_backward(begin + slot, begin + target.childCount, begin + target.childCount + 1);
+  *(begin + slot) = child;
+  target.childCount++;
+}
+
+void Trie::eraseChild(Index node, Index slot)
+{
+  Node &target{nodes[node]};
+  const auto begin{childSlots.begin() + target.childOffset};
+  std::copy(begin + slot + 1, begin + target.childCount, begin + slot);
+  target.childCount--;
+}
+
+void Trie::mergeWithOnlyChild(Index node)
+{
+  const Index child{childAt(node, 0)};
+  Node &parent{nodes[node]};
+  const Node &only{nodes[child]};
+
+  if (parent.labelOffset + parent.labelLength == only.labelOffset)
+  {
+    parent.labelLength += only.labelLength;
+  }
+  else
+  {
+    std::string merged{labelOf(node)};
+    merged.append(labelOf(child));
+    const Index offset{static_cast<Index>(labels.size())};
+    labels.append(merged);
+    wastedLabelBytes += parent.labelLength + only.labelLength;
+    parent.labelOffset = offset;
+    parent.labelLength += only.labelLength;
+  }
+
+  wastedSlots += parent.childCapacity;
+  parent.childOffset = only.childOffset;
+  parent.childCount = only.childCount;
+  parent.childCapacity = only.childCapacity;
+  parent.nodeKind = only.nodeKind;
+
+  nodes[child].childCapacity = 0;
+  nodes[child].labelLength = 0;
+  releaseNode(child);
+}
+
+void Trie::compactIfWasteful()
+{
+  if (wastedSlots * 2 <= childSlots.size() && wastedLabelBytes * 2 <= labels.size())
+    return;
+
+  std::vector<Index> packedSlots{};
+  std::string packedLabels{};
+  packedSlots.reserve(childSlots.size() - wastedSlots);
+  packedLabels.reserve(labels.size() - wastedLabelBytes);
+
+  std::vector<Index> pending{rootIndex};
+  while (!pending.empty())
+  {
+    const Index index{pending.back()};
+    pending.pop_back();
+    Node &node{nodes[index]};
+
+    const Index labelOffset{static_cast<Index>(packedLabels.size())};
+    packedLabels.append(labels, node.labelOffset, node.labelLength);
+    node.labelOffset = labelOffset;
+
+    const Index childOffset{static_cast<Index>(packedSlots.size())};
+    packedSlots.insert(packedSlots.end(), childSlots.begin() + node.childOffset,
+                       childSlots.begin() + node.childOffset + node.childCount);
+    node.childOffset = childOffset;
+    node.childCapacity = node.childCount;
+    for (Index i{}; i < node.childCount; ++i)
+      pending.push_back(packedSlots[childOffset + i]);
+  }
+
+  childSlots = std::move(packedSlots);
+  labels = std::move(packedLabels);
+  wastedSlots = 0;
+  wastedLabelBytes = 0;
+}
+
+bool Trie::visitFrom(Index node, std::string &current, const Visitor &visitor) const
+{
+  if (nodeAt(node).nodeKind != NodeKind::NotExecutable && !visitor(current))
+    return false;
+
+  for (Index i{}; i < nodeAt(node).childCount; ++i)
   {
-    current.push_back(entry.first);
-    collectFrom(entry.second.get(), current, results);
-    current.pop_back();
+    const Index child{childAt(node, i)};
+    const std::size_t size{current.size()};
+    current.append(labelOf(child));
+    const bool keepGoing{visitFrom(child, current, visitor)};
+    current.resize(size);
+    if (!keepGoing)
+      return false;
   }
+  return true;
+}
+
+std::string Trie::extendFrom(const Locus &locus, std::string_view prefix) const
+{
+  std::string result{prefix};
+  result.append(labelOf(locus.node).substr(locus.consumed));
+
+  Index node{locus.node};
+  while (nodeAt(node).childCount == 1 && nodeAt(node).nodeKind == NodeKind::NotExecutable)
+  {
+    node = childAt(node, 0);
+    result.append(labelOf(node));
+  }
+  return result;
 }
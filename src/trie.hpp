@@ -1,16 +1,21 @@
 #pragma once
 
-#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
 #include <optional>
 #include <string>
 #include <string_view>
-#include <unordered_map>
 #include <vector>
 
+// Path-compressed radix tree. Nodes, edge labels and child index arrays each
+// live in one contiguous arena; children are kept sorted by their first byte
+// so lookups binary-search and in-order walks come out already sorted.
 class Trie
 {
 public:
-  Trie() = default;
+  Trie();
 
   enum class NodeKind
   {
@@ -22,24 +27,104 @@ public:
   void clear();
   void insert(std::string_view word);
   void insert(std::string_view word, NodeKind nodeKind);
+  bool remove(std::string_view word);
   bool contains(std::string_view word) const;
   bool hasPrefix(std::string_view prefix) const;
   std::size_t countWithPrefix(std::string_view prefix) const;
   std::optional<std::string> uniqueCompletion(std::string_view prefix) const;
   std::string longestCommonPrefix(std::string_view prefix) const;
-  std::vector<std::string> collectWithPrefix(std::string_view prefix) const;
+  // Calls `visitor` with every word starting with `prefix`, in order,
+  // building each word in one reused buffer; the view is only valid during
+  // the call. Returning false from the visitor ends the walk.
+  using Visitor = std::function<bool(std::string_view word)>;
+  void visitWithPrefix(std::string_view prefix, const Visitor &visitor) const;
+  // The first `limit` words starting with `prefix`, in order. The walk
+  // stops there instead of materializing every match.
+  std::vector<std::string> collectWithPrefix(std::string_view prefix,
+                                             std::size_t limit = std::numeric_limits<std::size_t>::max()) const;
+  std::size_t memoryUsage() const;
+
+  // Flat image of the arenas. attachImage serves lookups straight out of
+  // `data` (typically an mmap) with no parsing; the memory must outlive the
+  // attachment. It checks the header, the sizes and a checksum written with
+  // the image, not the tree itself. The first mutation copies the image
+  // into owned arenas.
+  std::string serialize() const;
+  bool attachImage(const void *data, std::size_t size);
 
 private:
+  using Index = std::uint32_t;
+
   struct Node
   {
-    std::unordered_map<char, std::unique_ptr<Node>> children{};
+    Index labelOffset{0};
+    Index labelLength{0};
+    Index childOffset{0};
+    Index childCount{0};
+    Index childCapacity{0};
+    Index subtreeCount{0};
     NodeKind nodeKind{NodeKind::NotExecutable};
-    std::size_t subtreeCount{0};
   };
 
-  Node root{};
+  // Where a prefix ends: inside (or at the end of) the edge leading to `node`.
+  struct Locus
+  {
+    Index node{0};
+    Index consumed{0};
+  };
+
+  struct ImageHeader
+  {
+    std::uint32_t magic{};
+    std::uint32_t nodeCount{};
+    std::uint32_t slotCount{};
+    std::uint32_t freeCount{};
+    std::uint32_t labelSize{};
+    std::uint32_t wastedSlots{};
+    std::uint32_t wastedLabelBytes{};
+    std::uint32_t layout{};
+    // Of every byte after the header.
+    std::uint64_t checksum{};
+  };
+
+  struct MappedImage
+  {
+    const Node *nodes{nullptr};
+    std::size_t nodeCount{0};
+    const Index *childSlots{nullptr};
+    std::size_t slotCount{0};
+    std::string_view labels{};
+    std::size_t byteSize{0};
+  };
+
+  static constexpr Index rootIndex{0};
+  static constexpr std::uint32_t imageMagic{0x54524945};
+  static constexpr std::uint32_t imageVersion{3};
+
+  std::vector<Node> nodes{};
+  std::vector<Index> childSlots{};
+  std::string labels{};
+  std::vector<Index> freeNodes{};
+  std::size_t wastedSlots{0};
+  std::size_t wastedLabelBytes{0};
+  std::optional<MappedImage> mapped{};
 
-  Node *findNode(std::string_view text);
-  const Node *findNode(std::string_view text) const;
-  void collectFrom(const Node *node, std::string &current, std::vector<std::string> &results) const;
+  static std::uint32_t imageLayout();
+  static std::uint64_t imageChecksum(std::string_view bytes);
+  const Node &nodeAt(Index node) const;
+  void detachImage();
+  std::optional<Locus> locate(std::string_view text) const;
+  std::string_view labelOf(Index node) const;
+  unsigned char firstByte(Index node) const;
+  Index childAt(Index node, Index slot) const;
+  Index findChildSlot(Index node, unsigned char c, bool &found) const;
+  Index allocateNode(Index labelOffset, Index labelLength);
+  void releaseNode(Index node);
+  void reserveChildren(Index node, Index capacity);
+  void insertChild(Index node, Index slot, Index child);
+  void eraseChild(Index node, Index slot);
+  void mergeWithOnlyChild(Index node);
+  void compactIfWasteful();
+  bool visitFrom(Index node, std::string &current, const Visitor &visitor) const;
+  std::string extendFrom(const Locus &locus, std::string_view prefix) const;
 };
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Regression tests for $(...) and backtick substitution.
+# Usage: command_substitution.sh path/to/shell
+
+shell=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+failures=0
+
+expect()
+{
+  name=$1
+  wanted=$2
+  shift 2
+  got=$("$shell" "$@" 2>&1)
+  if [ "$got" != "$wanted" ]; then
+    printf '%s: expected [%s], got [%s]\n' "$name" "$wanted" "$got"
+    failures=$((failures + 1))
+  fi
+}
+
+# Output that looks like operators stays literal.
+expect redirection-in-output 'hi > injected' -c 'echo $(echo "hi > injected")'
+if [ -e injected ]; then
+  echo 'redirection-in-output: created a file named injected'
+  failures=$((failures + 1))
+fi
+expect pipe-in-output 'a | wc -c' -c 'echo $(echo "a | wc -c")'
+
+# Substitutions run when their command does, not when it is read.
+printf 'exit\necho $(touch created)\n' > script
+expect runs-after-exit '' script
+if [ -e created ]; then
+  echo 'runs-after-exit: substitution ran after exit'
+  failures=$((failures + 1))
+fi
+expect sees-earlier-cd '/' -c 'cd /
+echo $(pwd)'
+
+expect splitting 'xa by [a b] tick nested' -c 'echo x$(echo a   b)y "[$(echo a b)]" `echo tick` $(echo $(echo nested))'
+expect empty-output 'ab [] z' -c 'echo a$(true)b "[$(true)]" $(true) z'
+
+# A substitution left open across lines resumes where the last line ended.
+printf 'echo "[$(echo ")("\n  `echo x`\n)]"\n' > multiline
+expect multi-line '[)( x]' multiline
+
+exit $((failures > 0))
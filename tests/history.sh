@@ -0,0 +1,100 @@
+#!/bin/sh
+# Regression tests for the bounded history ring and HISTCONTROL.
+# Usage: history.sh path/to/shell
+
+shell=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+failures=0
+
+expect()
+{
+  name=$1
+  wanted=$2
+  shift 2
+  got=$(printf "$@" | "$shell" 2>&1)
+  if [ "$got" != "$wanted" ]; then
+    printf '%s: expected [%s], got [%s]\n' "$name" "$wanted" "$got"
+    failures=$((failures + 1))
+  fi
+}
+
+expect_file()
+{
+  name=$1
+  wanted=$2
+  got=$(cat "$3")
+  if [ "$got" != "$wanted" ]; then
+    printf '%s: expected [%s], got [%s]\n' "$name" "$wanted" "$got"
+    failures=$((failures + 1))
+  fi
+}
+
+# Entries are only added from the prompt, so HISTCONTROL and -a need an
+# interactive shell on a terminal.
+interactive()
+{
+  printf "$@" | HOME=$work HISTFILE= script -qec "$shell" /dev/null > /dev/null 2>&1
+}
+
+printf 'echo 1\necho 2\necho 3\necho 4\necho 5\n' > five
+printf 'echo x\necho y\n' > two
+
+# Reading into a bounded ring keeps the newest lines; entries that fall
+# off the front keep their numbers for the ones behind them.
+expect histsize-read '    1  echo 3
+    2  echo 4
+    3  echo 5' 'export HISTSIZE=3\nhistory -r five\nhistory\n'
+expect eviction-numbering '    3  echo 5
+    4  echo x
+    5  echo y
+    5  echo y' 'export HISTSIZE=3\nhistory -r five\nhistory -r two\nhistory\nhistory 1\n'
+expect histsize-raised '    3  echo 5
+    4  echo x
+    5  echo y
+    6  echo x
+    7  echo y' 'export HISTSIZE=3\nhistory -r five\nhistory -r two\nexport HISTSIZE=10\nhistory -r two\nhistory\n'
+expect clear '    1  echo x
+    2  echo y' 'history -r five\nhistory -c\nhistory -r two\nhistory\n'
+
+# -w keeps only the newest HISTFILESIZE entries, and HISTSIZE when that
+# is unset.
+expect histfilesize-write '' 'history -r five\nexport HISTFILESIZE=2\nhistory -w written\n'
+expect_file histfilesize-write 'echo 4
+echo 5' written
+expect histsize-write '' 'history -r five\nexport HISTSIZE=3\nhistory -w written\n'
+expect_file histsize-write 'echo 3
+echo 4
+echo 5' written
+
+if command -v script > /dev/null 2>&1; then
+  cp two appended
+  interactive 'history -r appended\necho new\necho new\nhistory -a appended\necho later\nhistory -a appended\nexit\n'
+  expect_file append-new-only 'echo x
+echo y
+echo new
+echo new
+history -a appended
+echo later
+history -a appended' appended
+
+  interactive 'export HISTCONTROL=ignoredups\necho a\necho a\necho b\necho a\nhistory -w ignored\nexit\n'
+  expect_file ignoredups 'export HISTCONTROL=ignoredups
+echo a
+echo b
+echo a
+history -w ignored' ignored
+
+  interactive 'export HISTCONTROL=erasedups\necho a\necho b\necho a\necho b\nhistory -w erased\nexit\n'
+  expect_file erasedups 'export HISTCONTROL=erasedups
+echo a
+echo b
+history -w erased' erased
+
+  interactive 'export HISTSIZE=2\nexport HISTCONTROL=erasedups\necho a\necho b\necho a\nhistory -w bounded\nexit\n'
+  expect_file erasedups-bounded 'echo a
+history -w bounded' bounded
+fi
+
+exit $((failures > 0))
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Regression tests for SHELL_TRACE output from forked children.
+# Usage: tracing.sh path/to/shell
+
+shell=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+failures=0
+
+# Pid of every complete event named $1 in the trace.
+span_pids()
+{
+  grep -o "{\"name\":\"$1\",\"cat\":\"shell\",\"ph\":\"X\",\"pid\":[0-9]*" trace.json | sed 's/.*"pid"://'
+}
+
+# `cd` changes the shell's state, so as a pipeline stage or in a
+# substitution it runs in a forked child.
+SHELL_TRACE=trace.json "$shell" -c 'cd / | cat
+echo $(cd /)
+true' > /dev/null
+parent=$(span_pids 'PipelineExecutor::waitForStages' | head -n 1)
+
+stage=$(span_pids stage | head -n 1)
+if [ -z "$stage" ] || [ "$stage" = "$parent" ]; then
+  echo "pipeline-stage: no span from the forked stage (parent $parent, got [$stage])"
+  failures=$((failures + 1))
+fi
+
+if ! span_pids 'Shell::runCommand' | grep -qv "^$parent\$"; then
+  echo 'substitution: no span from the forked subshell'
+  failures=$((failures + 1))
+fi
+
+if [ "$(span_pids fork | sort -u)" != "$parent" ]; then
+  echo 'fork: span recorded by the child as well as the parent'
+  failures=$((failures + 1))
+fi
+
+if [ "$(head -n 1 trace.json)" != '[' ]; then
+  echo 'header: trace does not start with ['
+  failures=$((failures + 1))
+fi
+
+exit $((failures > 0))